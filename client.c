@@ -58,16 +58,18 @@ enum {
 	PORT     =  2,
 	MAC      =  3,
 	IP       =  4,
-	CONNS    =  5,
-	RX_BYTES =  6,
-	RX_PKTS  =  7,
-	TX_BYTES =  8,
-	TX_PKTS  =  9,
-
-	HOST     = 10,
-	LAYER7   = 11,
-
-	MAX      = 12
+	ZONE     =  5,
+	MARK     =  6,
+	CONNS    =  7,
+	RX_BYTES =  8,
+	RX_PKTS  =  9,
+	TX_BYTES = 10,
+	TX_PKTS  = 11,
+
+	HOST     = 12,
+	LAYER7   = 13,
+
+	MAX      = 14
 };
 
 static struct field fields[MAX] = {
@@ -76,6 +78,8 @@ static struct field fields[MAX] = {
 	[PORT]     = f("port",     dst_port),
 	[MAC]      = f("mac",      src_mac),
 	[IP]       = f("ip",       src_addr),
+	[ZONE]     = f("zone",     zone),
+	[MARK]     = f("mark",     mark),
 	[CONNS]    = f("conns",    count),
 	[RX_BYTES] = f("rx_bytes", in_bytes),
 	[RX_PKTS]  = f("rx_pkts",  in_pkts),
@@ -86,7 +90,7 @@ static struct field fields[MAX] = {
 	  offsetof(struct record, count) - offsetof(struct record, src_mac) },
 
 	[LAYER7]   = { "layer7", offsetof(struct record, proto),
-	  offsetof(struct record, src_mac) - offsetof(struct record, proto) }
+	  offsetof(struct record, zone) - offsetof(struct record, proto) }
 };
 
 
@@ -110,6 +114,22 @@ struct command {
 };
 
 
+/* records keep their actual port, so records matching the same port range
+ * or wildcard rule are told apart by the rule they resolve to */
+static int
+cmp_layer7(const struct record *r1, const struct record *r2)
+{
+	struct protocol *p1, *p2;
+
+	p1 = lookup_protocol(r1->proto, be16toh(r1->dst_port));
+	p2 = lookup_protocol(r2->proto, be16toh(r2->dst_port));
+
+	if (!p1 && !p2)
+		return memcmp(&r1->proto, &r2->proto, fields[LAYER7].len);
+
+	return (p1 > p2) - (p1 < p2);
+}
+
 static int
 cmp_fn(const void *k1, const void *k2, void *ptr)
 {
@@ -122,7 +142,10 @@ cmp_fn(const void *k1, const void *k2, void *ptr)
 		n = (r ? -group[1 + i] : group[1 + i]) - 1;
 		f = &fields[n];
 
-		diff = memcmp(k1 + f->off, k2 + f->off, f->len);
+		if (n == LAYER7)
+			diff = cmp_layer7(k1, k2);
+		else
+			diff = memcmp(k1 + f->off, k2 + f->off, f->len);
 
 		if (diff != 0)
 			return r ? -diff : diff;
@@ -318,6 +341,12 @@ handle_show(void)
 			printf("%c Port ", columns[PORT]);
 	}
 
+	if (columns[ZONE])
+		printf("%c Zone ", columns[ZONE]);
+
+	if (columns[MARK])
+		printf("%c Mark ", columns[MARK]);
+
 	printf("  %c Conn.   %c Downld. ( %c Pkts. )    %c Upload ( %c Pkts. )\n",
 	       columns[CONNS],
 	       columns[RX_BYTES], columns[RX_PKTS],
@@ -354,6 +383,12 @@ handle_show(void)
 				printf("%5u  ", be16toh(rec->dst_port));
 		}
 
+		if (columns[ZONE])
+			printf("%5u  ", be16toh(rec->zone));
+
+		if (columns[MARK])
+			printf("%5u  ", be16toh(rec->mark));
+
 		printf("%s  ",   format_num(rec->count));
 		printf("%sB ",   format_num(rec->in_bytes));
 		printf("(%s)  ", format_num(rec->in_pkts));
@@ -454,6 +489,14 @@ handle_json(void)
 				printf("\"%s\"", format_macaddr(&rec->src_mac.ea));
 				break;
 
+			case ZONE:
+				printf("%"PRIu16, be16toh(rec->zone));
+				break;
+
+			case MARK:
+				printf("%"PRIu16, be16toh(rec->mark));
+				break;
+
 			case IP:
 				printf("\"%s\"", format_ipaddr(rec->family, &rec->src_addr));
 				break;
@@ -567,6 +610,14 @@ handle_csv(void)
 				print_csv_str(format_macaddr(&rec->src_mac.ea));
 				break;
 
+			case ZONE:
+				printf("%"PRIu16, be16toh(rec->zone));
+				break;
+
+			case MARK:
+				printf("%"PRIu16, be16toh(rec->mark));
+				break;
+
 			case IP:
 				print_csv_str(format_ipaddr(rec->family, &rec->src_addr));
 				break;
@@ -659,12 +710,63 @@ handle_commit(void)
 	return -strtol(reply, NULL, 10);
 }
 
+static int
+print_reply(const char *cmd)
+{
+	char buf[128];
+	int ctrl_socket;
+	ssize_t len;
+
+	ctrl_socket = usock(USOCK_UNIX, opt.socket, NULL);
+
+	if (!ctrl_socket)
+		return -errno;
+
+	if (send(ctrl_socket, cmd, strlen(cmd), 0) != strlen(cmd)) {
+		close(ctrl_socket);
+		return -errno;
+	}
+
+	while ((len = recv(ctrl_socket, buf, sizeof(buf), 0)) > 0)
+		fwrite(buf, 1, len, stdout);
+
+	close(ctrl_socket);
+
+	return 0;
+}
+
+static int
+handle_stats(void)
+{
+	return print_reply("stats");
+}
+
+static int
+handle_addresses(void)
+{
+	return print_reply("addresses");
+}
+
+static int
+handle_compile(void)
+{
+	int err = save_protocols(opt.protocol_db);
+
+	if (!err)
+		printf("Compiled %s to %s.bin\n", opt.protocol_db, opt.protocol_db);
+
+	return err;
+}
+
 static struct command commands[] = {
 	{ "show", handle_show },
 	{ "json", handle_json },
 	{ "csv", handle_csv },
 	{ "list", handle_list },
 	{ "commit", handle_commit },
+	{ "stats", handle_stats },
+	{ "addresses", handle_addresses },
+	{ "compile-protocols", handle_compile },
 };
 
 
@@ -241,7 +241,6 @@ database_insert(struct dbhandle *h, struct record *rec)
 	return 0;
 }
 
-#define add64(x, y) x = htobe64(be64toh(x) + be64toh(y))
 
 int
 database_update(struct dbhandle *h, struct record *rec)
@@ -626,7 +625,7 @@ database_archive(struct dbhandle *h)
 		database_reindex(h);
 
 		/* carry over yet open streams to new database */
-		err = nfnetlink_dump(true);
+		err = nfnetlink_dump(true, NULL);
 
 		if (err)
 			return err;
@@ -52,11 +52,15 @@
 #define db_record(db, n) \
 	(struct record *)&(db)->records[(n)];
 
+#define add64(x, y) x = htobe64(be64toh(x) + be64toh(y))
+
 
 struct record {
 	uint8_t family;
 	uint8_t proto;
 	uint16_t dst_port;
+	uint16_t zone;
+	uint16_t mark;
 	union {
 		struct ether_addr ea;
 		uint64_t u64;
@@ -0,0 +1,309 @@
+/*
+  ISC License
+
+  Copyright (c) 2016-2017, Jo-Philipp Wich <jo@mein.io>
+
+  Permission to use, copy, modify, and/or distribute this software for any
+  purpose with or without fee is hereby granted, provided that the above
+  copyright notice and this permission notice appear in all copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+  REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+  AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+  INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+  LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+  OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+  PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <endian.h>
+
+#include <sys/socket.h>
+#include <linux/filter.h>
+#include <linux/netlink.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+
+#include "filter.h"
+#include "subnets.h"
+
+/*
+ * Compiles the configured local subnets into a classic BPF program which
+ * is attached to the conntrack event socket. The program mirrors the
+ * classification done by account_flow() and lets the kernel drop events
+ * of local -> local and remote -> remote flows before they are copied to
+ * userspace. Anything the program does not understand is accepted.
+ */
+
+#if __BYTE_ORDER == __LITTLE_ENDIAN
+# define NLMSG_TYPE_HI  (offsetof(struct nlmsghdr, nlmsg_type) + 1)
+# define NLMSG_FLAGS_LO (offsetof(struct nlmsghdr, nlmsg_flags))
+#else
+# define NLMSG_TYPE_HI  (offsetof(struct nlmsghdr, nlmsg_type))
+# define NLMSG_FLAGS_LO (offsetof(struct nlmsghdr, nlmsg_flags) + 1)
+#endif
+
+#define NFGEN_FAMILY (NLMSG_HDRLEN + offsetof(struct nfgenmsg, nfgen_family))
+#define CTA_OFFSET   (NLMSG_HDRLEN + NLMSG_ALIGN(sizeof(struct nfgenmsg)))
+
+/* scratch memory slot holding the offset of the CTA_TUPLE_IP nest */
+#define M_TUPLE_IP 15
+
+#define MAX_LABELS 16
+
+enum {
+	L_ACCEPT,
+	L_REJECT,
+	L_IPV4,
+	L_IPV4_REPLY,
+	L_IPV6,
+	L_IPV6_REPLY,
+	L_DYNAMIC
+};
+
+struct program {
+	struct sock_filter *insns;
+	unsigned int len;
+	bool overflow;
+	int nlabels;
+	int labels[MAX_LABELS];
+};
+
+
+static void
+emit(struct program *p, uint16_t code, uint32_t k, uint8_t jt, uint8_t jf)
+{
+	if (p->len >= BPF_MAXINSNS) {
+		p->overflow = true;
+		return;
+	}
+
+	p->insns[p->len++] = (struct sock_filter)BPF_JUMP(code, k, jt, jf);
+}
+
+/* unconditional jumps are used to reach labels since the 8 bit offsets of
+ * conditional jumps cannot span long subnet lists, the target offset is
+ * stored as label number and resolved in resolve_labels() */
+static void
+emit_goto(struct program *p, int label)
+{
+	emit(p, BPF_JMP|BPF_JA, label, 0, 0);
+}
+
+static int
+new_label(struct program *p)
+{
+	p->labels[p->nlabels] = -1;
+	return p->nlabels++;
+}
+
+static void
+bind_label(struct program *p, int label)
+{
+	p->labels[label] = p->len;
+}
+
+static void
+resolve_labels(struct program *p)
+{
+	unsigned int i;
+
+	for (i = 0; i < p->len; i++)
+		if (p->insns[i].code == (BPF_JMP|BPF_JA))
+			p->insns[i].k = p->labels[p->insns[i].k] - (i + 1);
+}
+
+static void
+emit_find_attr(struct program *p, uint32_t ad, uint32_t type)
+{
+	emit(p, BPF_LDX|BPF_IMM, type, 0, 0);
+	emit(p, BPF_LD|BPF_B|BPF_ABS, SKF_AD_OFF + ad, 0, 0);
+
+	/* accept message if the attribute is not present */
+	emit(p, BPF_JMP|BPF_JEQ|BPF_K, 0, 0, 1);
+	emit_goto(p, L_ACCEPT);
+}
+
+static void
+emit_load_addr(struct program *p, int family)
+{
+	int i;
+
+	emit(p, BPF_MISC|BPF_TAX, 0, 0, 0);
+
+	for (i = 0; i < (family == AF_INET6 ? 4 : 1); i++) {
+		emit(p, BPF_LD|BPF_W|BPF_IND, NLA_HDRLEN + i * 4, 0, 0);
+		emit(p, BPF_ST, i, 0, 0);
+	}
+}
+
+static void
+emit_match_subnets(struct program *p, int family, int match, int nomatch)
+{
+	struct subnet *net = NULL;
+	uint32_t mask[4], addr[4];
+	int i, n, words;
+
+	while ((net = next_subnet(net)) != NULL) {
+		if (net->family != family)
+			continue;
+
+		if (family == AF_INET6) {
+			for (i = 0; i < 4; i++) {
+				mask[i] = be32toh(net->smask.in6.s6_addr32[i]);
+				addr[i] = be32toh(net->saddr.in6.s6_addr32[i]) & mask[i];
+			}
+		}
+		else {
+			mask[0] = net->smask.in.s_addr;
+			addr[0] = net->saddr.in.s_addr & mask[0];
+		}
+
+		for (i = 0, words = 0; i < (family == AF_INET6 ? 4 : 1); i++)
+			if (mask[i])
+				words++;
+
+		/* compare each non-zero mask word, skip to the next subnet on
+		 * mismatch, jump to the match label if all words are equal */
+		for (i = 0, n = 0; i < (family == AF_INET6 ? 4 : 1); i++) {
+			if (!mask[i])
+				continue;
+
+			n++;
+
+			emit(p, BPF_LD|BPF_MEM, i, 0, 0);
+			emit(p, BPF_ALU|BPF_AND|BPF_K, mask[i], 0, 0);
+			emit(p, BPF_JMP|BPF_JEQ|BPF_K, addr[i], 0, (words - n) * 3 + 1);
+		}
+
+		emit_goto(p, match);
+	}
+
+	emit_goto(p, nomatch);
+}
+
+static void
+emit_tuple(struct program *p, int family, uint32_t tuple, int next)
+{
+	int src_local = new_label(p);
+
+	emit(p, BPF_LD|BPF_IMM, CTA_OFFSET, 0, 0);
+	emit_find_attr(p, SKF_AD_NLATTR, tuple);
+	emit_find_attr(p, SKF_AD_NLATTR_NEST, CTA_TUPLE_IP);
+	emit(p, BPF_ST, M_TUPLE_IP, 0, 0);
+
+	/* source address must be local ... */
+	emit_find_attr(p, SKF_AD_NLATTR_NEST,
+	               family == AF_INET6 ? CTA_IP_V6_SRC : CTA_IP_V4_SRC);
+	emit_load_addr(p, family);
+	emit_match_subnets(p, family, src_local, next);
+
+	/* ... and destination address must be remote */
+	bind_label(p, src_local);
+	emit(p, BPF_LD|BPF_MEM, M_TUPLE_IP, 0, 0);
+	emit_find_attr(p, SKF_AD_NLATTR_NEST,
+	               family == AF_INET6 ? CTA_IP_V6_DST : CTA_IP_V4_DST);
+	emit_load_addr(p, family);
+	emit_match_subnets(p, family, next, L_ACCEPT);
+}
+
+static int
+compile_program(struct program *p)
+{
+	p->nlabels = L_DYNAMIC;
+
+	/* accept everything which is not a ctnetlink message */
+	emit(p, BPF_LD|BPF_B|BPF_ABS, NLMSG_TYPE_HI, 0, 0);
+	emit(p, BPF_JMP|BPF_JEQ|BPF_K, NFNL_SUBSYS_CTNETLINK, 1, 0);
+	emit_goto(p, L_ACCEPT);
+
+	/* accept multipart messages, these are never broadcast events */
+	emit(p, BPF_LD|BPF_B|BPF_ABS, NLMSG_FLAGS_LO, 0, 0);
+	emit(p, BPF_JMP|BPF_JSET|BPF_K, NLM_F_MULTI, 0, 1);
+	emit_goto(p, L_ACCEPT);
+
+	emit(p, BPF_LD|BPF_B|BPF_ABS, NFGEN_FAMILY, 0, 0);
+	emit(p, BPF_JMP|BPF_JEQ|BPF_K, AF_INET, 0, 1);
+	emit_goto(p, L_IPV4);
+	emit(p, BPF_JMP|BPF_JEQ|BPF_K, AF_INET6, 0, 1);
+	emit_goto(p, L_IPV6);
+	emit_goto(p, L_ACCEPT);
+
+	bind_label(p, L_IPV4);
+	emit_tuple(p, AF_INET, CTA_TUPLE_ORIG, L_IPV4_REPLY);
+	bind_label(p, L_IPV4_REPLY);
+	emit_tuple(p, AF_INET, CTA_TUPLE_REPLY, L_REJECT);
+
+	bind_label(p, L_IPV6);
+	emit_tuple(p, AF_INET6, CTA_TUPLE_ORIG, L_IPV6_REPLY);
+	bind_label(p, L_IPV6_REPLY);
+	emit_tuple(p, AF_INET6, CTA_TUPLE_REPLY, L_REJECT);
+
+	bind_label(p, L_ACCEPT);
+	emit(p, BPF_RET|BPF_K, 0xffffffff, 0, 0);
+
+	bind_label(p, L_REJECT);
+	emit(p, BPF_RET|BPF_K, 0, 0, 0);
+
+	if (p->overflow)
+		return -E2BIG;
+
+	resolve_labels(p);
+
+	return 0;
+}
+
+static int
+filter_detach(int fd)
+{
+	if (setsockopt(fd, SOL_SOCKET, SO_DETACH_FILTER, NULL, 0) &&
+	    errno != ENOENT)
+		return -errno;
+
+	return 0;
+}
+
+/* attaching replaces a previously attached program; should the new one
+ * fail to build or attach, the old one is detached since it would keep
+ * dropping events of newly added subnets */
+int
+filter_attach(int fd)
+{
+	struct program p = { };
+	struct sock_fprog prog;
+	int err;
+
+	if (!next_subnet(NULL))
+		return filter_detach(fd);
+
+	p.insns = calloc(BPF_MAXINSNS, sizeof(*p.insns));
+
+	if (!p.insns) {
+		filter_detach(fd);
+		return -ENOMEM;
+	}
+
+	err = compile_program(&p);
+
+	if (!err) {
+		prog.len = p.len;
+		prog.filter = p.insns;
+
+		if (setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER,
+		               &prog, sizeof(prog)))
+			err = -errno;
+	}
+
+	free(p.insns);
+
+	if (err)
+		filter_detach(fd);
+
+	return err;
+}
@@ -17,13 +17,16 @@
 */
 
 #include <libubox/avl.h>
+#include <libubox/uloop.h>
 
 #include <stdint.h>
 #include <stdbool.h>
 #include <string.h>
 #include <errno.h>
 
+#include <time.h>
 #include <endian.h>
+#include <sys/socket.h>
 
 #include <netlink/msg.h>
 #include <netlink/attr.h>
@@ -32,352 +35,853 @@
 #include <linux/rtnetlink.h>
 
 #include "neigh.h"
+#include "nlbwmon.h"
+
+#define NEIGH_HASH_MIN 256
+#define NEIGH_NEGATIVE_TTL 30
+#define NEIGH_NEGATIVE_LIMIT 1024
+#define NEIGH_AGING_INTERVAL 60000
+#define NEIGH_ADDR_DELAY 250
+
+/* neighbor entries are kept in a chained hash table which doubles in size
+ * whenever the load factor exceeds one */
+static struct neigh_entry **neighbors = NULL;
+static uint32_t n_buckets = 0;
+
+/* entries ordered by last use, least recently used first */
+static LIST_HEAD(neighbors_lru);
+static struct uloop_timeout aging_tm = { };
+
+/* unresolved addresses with a pending neighbor query, kept apart from the
+ * resolved entries so that they cannot evict them */
+static LIST_HEAD(negative_lru);
+static uint32_t n_negative = 0;
+
+struct neigh_stats neigh_stats = { };
+
+/* recent addresses of collapsed IPv6 hosts, subject to the same size limit
+ * and aging as the neighbor entries */
+static struct avl_tree recent;
+static LIST_HEAD(recent_lru);
+static uint32_t n_recent = 0;
+
+/* local interface addresses and link layer addresses, used to resolve
+ * router local addresses lacking a neighbor entry */
+static struct avl_tree addresses;
+static struct avl_tree links;
+
+struct link_entry {
+	int ifindex;
+	struct ether_addr mac;
+	struct avl_node node;
+};
 
-static struct avl_tree neighbors;
+/* the caches are kept current through rtnetlink notifications,
+ * initial and resync dumps are requested on the same socket */
+static struct nl_sock *rt_event = NULL;
+static struct uloop_fd rt_fd = { };
+static unsigned char rt_buf[32768];
+
+enum {
+	RT_DUMP_NEIGH = (1 << 0),
+	RT_DUMP_LINK  = (1 << 1),
+	RT_DUMP_ADDR  = (1 << 2),
+	RT_DUMP_ALL   = RT_DUMP_NEIGH | RT_DUMP_LINK | RT_DUMP_ADDR,
+};
 
-static struct nl_sock *rt_sock = NULL;
-static struct nl_cb *rt_cb = NULL;
-static bool rt_done = false;
+static unsigned int rt_dumps_pending = 0;
+static bool rt_dumping = false;
+static uint32_t rt_dump_seq = 0;
 
-static int
-cb_done(struct nl_msg *msg, void *arg)
+static neigh_notify_cb notify_cb = NULL;
+
+/* address changes are reported once the burst of updates settled */
+static neigh_addr_notify_cb addr_notify_cb = NULL;
+static struct uloop_timeout addr_tm = { };
+
+static void
+neigh_key_init(union neigh_key *key, int family, const void *addr)
 {
-	rt_done = true;
-	return NL_STOP;
+	memset(key, 0, sizeof(*key));
+
+	if (family == AF_INET6) {
+		key->data.family = AF_INET6;
+		key->data.addr.in6 = *(struct in6_addr *)addr;
+	}
+	else {
+		key->data.family = AF_INET;
+		key->data.addr.in.s_addr = be32toh(((struct in_addr *)addr)->s_addr);
+	}
 }
 
-static int
-cb_error(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg)
+static time_t
+neigh_now(void)
 {
-	rt_done = true;
-	return NL_STOP;
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec;
+}
+
+static uint32_t
+neigh_hash(const union neigh_key *key)
+{
+	uint32_t i, h = 0x811c9dc5;
+
+	for (i = 0; i < sizeof(key->u32) / sizeof(key->u32[0]); i++)
+		h = (h ^ key->u32[i]) * 0x01000193;
+
+	return h ^ (h >> 16);
+}
+
+static struct neigh_entry *
+neigh_find(const union neigh_key *key)
+{
+	struct neigh_entry *ptr;
+
+	if (!n_buckets)
+		return NULL;
+
+	for (ptr = neighbors[neigh_hash(key) & (n_buckets - 1)]; ptr; ptr = ptr->next)
+		if (!memcmp(&ptr->key, key, sizeof(*key)))
+			return ptr;
+
+	return NULL;
 }
 
 static int
-rt_connect(void)
+neigh_grow(void)
 {
-	int err = -ENOMEM;
+	uint32_t i, n = n_buckets ? n_buckets * 2 : NEIGH_HASH_MIN;
+	struct neigh_entry **tbl, *ptr, *next;
 
-	rt_sock = nl_socket_alloc();
-	if (!rt_sock)
-		goto out;
+	tbl = calloc(n, sizeof(*tbl));
 
-	rt_cb = nl_cb_alloc(NL_CB_DEFAULT);
-	if (!rt_cb)
-		goto out;
+	if (!tbl)
+		return -ENOMEM;
 
-	err = nl_connect(rt_sock, NETLINK_ROUTE);
-	if (err < 0)
-		goto out;
+	for (i = 0; i < n_buckets; i++) {
+		for (ptr = neighbors[i]; ptr; ptr = next) {
+			next = ptr->next;
+			ptr->next = tbl[neigh_hash(&ptr->key) & (n - 1)];
+			tbl[neigh_hash(&ptr->key) & (n - 1)] = ptr;
+		}
+	}
+
+	free(neighbors);
 
-	nl_cb_set(rt_cb, NL_CB_FINISH, NL_CB_CUSTOM, cb_done, NULL);
-	nl_cb_err(rt_cb, NL_CB_CUSTOM, cb_error, NULL);
+	neighbors = tbl;
+	n_buckets = n;
 
 	return 0;
+}
 
-out:
-	if (rt_cb)
-		nl_cb_put(rt_cb);
+static void
+neigh_touch(struct neigh_entry *ptr)
+{
+	ptr->used = neigh_now();
+	list_move_tail(&ptr->lru, &neighbors_lru);
+}
 
-	if (rt_sock)
-		nl_socket_free(rt_sock);
+static void
+neigh_del(struct neigh_entry *ptr)
+{
+	struct neigh_entry **pp;
 
-	return err;
-}
+	pp = &neighbors[neigh_hash(&ptr->key) & (n_buckets - 1)];
 
+	while (*pp != ptr)
+		pp = &(*pp)->next;
 
-struct neigh_query {
-	int family;
-	const void *addr;
-	struct ether_addr *mac;
-};
+	*pp = ptr->next;
 
-static int
-neigh_parse(struct nl_msg *msg, void *arg)
+	list_del(&ptr->lru);
+
+	if (ptr->negative)
+		n_negative--;
+	else
+		neigh_stats.entries--;
+
+	free(ptr);
+}
+
+static void
+recent_del(struct neigh_recent *rh)
 {
-	struct nlmsghdr *hdr = nlmsg_hdr(msg);
-	struct ndmsg *nd = NLMSG_DATA(hdr);
-	struct nlattr *tb[NDA_MAX+1];
+	avl_delete(&recent, &rh->node);
+	list_del(&rh->lru);
+	free(rh);
 
-	struct neigh_query *query = arg;
-	struct ether_addr empty = { };
-	static struct ether_addr res;
+	n_recent--;
+}
 
-	if (hdr->nlmsg_type != RTM_NEWNEIGH || nd->ndm_family != query->family)
-		return NL_SKIP;
+static void
+handle_aging(struct uloop_timeout *tm)
+{
+	struct neigh_recent *rh, *rtmp;
+	struct neigh_entry *ptr, *tmp;
+	time_t now = neigh_now();
 
-	if (nd->ndm_state & (NUD_NOARP | NUD_FAILED | NUD_INCOMPLETE))
-		return NL_SKIP;
+	list_for_each_entry_safe(rh, rtmp, &recent_lru, lru) {
+		if (rh->used + opt.neigh.timeout > now)
+			break;
 
-	if (nlmsg_parse(hdr, sizeof(*nd), tb, NDA_MAX, NULL))
-		return NL_SKIP;
+		recent_del(rh);
+	}
 
-	if (!tb[NDA_LLADDR] || !tb[NDA_DST])
-		return NL_SKIP;
+	uloop_timeout_set(tm, NEIGH_AGING_INTERVAL);
 
-	if (memcmp(nla_data(tb[NDA_DST]), query->addr, nla_len(tb[NDA_DST])))
-		return NL_SKIP;
+	list_for_each_entry_safe(ptr, tmp, &neighbors_lru, lru) {
+		if (ptr->used + opt.neigh.timeout > now)
+			break;
 
-	if (nla_len(tb[NDA_LLADDR]) > sizeof(res))
-		return NL_SKIP;
+		neigh_del(ptr);
+		neigh_stats.evictions++;
+	}
 
-	if (!memcmp(nla_data(tb[NDA_LLADDR]), &empty, nla_len(tb[NDA_LLADDR])))
-		return NL_SKIP;
+	list_for_each_entry_safe(ptr, tmp, &negative_lru, lru) {
+		if (ptr->negative > now)
+			break;
 
-	memset(&res, 0, sizeof(res));
-	memcpy(&res, nla_data(tb[NDA_LLADDR]), nla_len(tb[NDA_LLADDR]));
-	query->mac = &res;
+		neigh_del(ptr);
+	}
+}
 
-	return NL_SKIP;
+/* make room for one more entry by evicting the least recently used one */
+static void
+neigh_reserve(bool negative)
+{
+	if (negative && n_negative >= NEIGH_NEGATIVE_LIMIT) {
+		neigh_del(list_first_entry(&negative_lru, struct neigh_entry, lru));
+	}
+	else if (!negative && opt.neigh.limit &&
+	         neigh_stats.entries >= opt.neigh.limit) {
+		neigh_del(list_first_entry(&neighbors_lru, struct neigh_entry, lru));
+		neigh_stats.evictions++;
+	}
 }
 
-static struct ether_addr *
-ipaddr_to_macaddr(int family, const void *addr)
+static struct neigh_entry *
+neigh_add(const union neigh_key *key, time_t negative)
 {
-	struct neigh_query query = { .family = family, .addr = addr };
-	struct ndmsg ndm = { .ndm_family = family };
-	struct nl_msg *msg = NULL;
+	struct neigh_entry *ptr;
+	uint32_t idx;
 
-	msg = nlmsg_alloc_simple(RTM_GETNEIGH, NLM_F_REQUEST | NLM_F_DUMP);
+	neigh_reserve(negative);
 
-	if (!msg)
+	if (neigh_stats.entries + n_negative >= n_buckets &&
+	    neigh_grow() && !n_buckets)
 		return NULL;
 
-	nlmsg_append(msg, &ndm, sizeof(ndm), 0);
+	ptr = calloc(1, sizeof(*ptr));
 
-	rt_done = false;
+	if (!ptr)
+		return NULL;
 
-	nl_cb_set(rt_cb, NL_CB_VALID, NL_CB_CUSTOM, neigh_parse, &query);
-	nl_send_auto_complete(rt_sock, msg);
-	nlmsg_free(msg);
+	idx = neigh_hash(key) & (n_buckets - 1);
 
-	while (!rt_done)
-		nl_recvmsgs(rt_sock, rt_cb);
+	ptr->key = *key;
+	ptr->negative = negative;
+	ptr->next = neighbors[idx];
+	neighbors[idx] = ptr;
+
+	if (negative) {
+		list_add_tail(&ptr->lru, &negative_lru);
+		n_negative++;
+	}
+	else {
+		list_add_tail(&ptr->lru, &neighbors_lru);
+		neigh_stats.entries++;
+	}
 
-	return query.mac;
+	return ptr;
 }
 
+static void
+neigh_notify(const union neigh_key *key)
+{
+	struct in6_addr addr = { };
 
-struct ifindex_query {
-	int family;
-	const void *addr;
-	int ifindex;
-};
+	if (key->data.family == AF_INET6)
+		addr = key->data.addr.in6;
+	else
+		addr.s6_addr32[0] = htobe32(key->data.addr.in.s_addr);
+
+	notify_cb(key->data.family, &addr);
+}
 
 static int
-ipaddr_parse(struct nl_msg *msg, void *arg)
+neigh_store(union neigh_key *key, struct ether_addr *mac)
 {
-	struct nlmsghdr *hdr = nlmsg_hdr(msg);
-	struct ifaddrmsg *ifa;
-	struct nlattr *addr, *tb[__IFA_MAX+1];
-	struct ifindex_query *query = arg;
-	int len = hdr->nlmsg_len;
+	struct neigh_entry *ptr;
+	bool resolved = false;
 
-	for (; nlmsg_ok(hdr, len); hdr = nlmsg_next(hdr, &len)) {
-		if (hdr->nlmsg_type != RTM_NEWADDR)
-			continue;
+	ptr = neigh_find(key);
+
+	/* unresolved entries are replaced and reported as newly resolvable */
+	if (ptr && ptr->negative) {
+		neigh_del(ptr);
+		ptr = NULL;
+	}
 
-		ifa = nlmsg_data(hdr);
+	if (!ptr) {
+		ptr = neigh_add(key, 0);
 
-		if (ifa->ifa_family != query->family)
-			continue;
+		if (!ptr)
+			return -ENOMEM;
+
+		resolved = true;
+	}
+
+	ptr->mac = *mac;
+
+	neigh_touch(ptr);
 
-		if (nlmsg_parse(hdr, sizeof(*ifa), tb, __IFA_MAX, NULL))
+	if (resolved && notify_cb)
+		neigh_notify(key);
+
+	return 0;
+}
+
+/* interface of the longest local prefix covering the given address */
+static int
+neigh_ifindex(const union neigh_key *key)
+{
+	const uint8_t *a, *b;
+	struct addr_entry *ae;
+	int bits, best = -1, ifindex = 0;
+
+	avl_for_each_element(&addresses, ae, node) {
+		if (ae->key.data.family != key->data.family ||
+		    ae->prefixlen <= best)
 			continue;
 
-		addr = tb[IFA_LOCAL] ? tb[IFA_LOCAL] : tb[IFA_ADDRESS];
+		a = (const uint8_t *)&ae->key.data.addr;
+		b = (const uint8_t *)&key->data.addr;
 
-		if (!addr || memcmp(nla_data(addr), query->addr, nla_len(addr)))
+		for (bits = ae->prefixlen; bits >= 8; bits -= 8, a++, b++)
+			if (*a != *b)
+				break;
+
+		if (bits >= 8 || (bits && ((*a ^ *b) >> (8 - bits))))
 			continue;
 
-		query->ifindex = ifa->ifa_index;
+		best = ae->prefixlen;
+		ifindex = ae->ifindex;
 	}
 
-	return NL_SKIP;
+	return ifindex;
 }
 
-static int
-ipaddr_to_ifindex(int family, const void *addr)
+/* ask the kernel for a neighbor entry missing from the cache, e.g. after
+ * it got evicted, the answer is handled like a notification */
+static void
+neigh_query(const union neigh_key *key)
 {
-	struct ifindex_query query = { .family = family, .addr = addr };
-	struct ifaddrmsg ifa = { .ifa_family = family };
-	struct nl_msg *msg = NULL;
+	struct ndmsg ndm = { .ndm_family = key->data.family };
+	struct nl_msg *msg;
+	int alen;
 
-	msg = nlmsg_alloc_simple(RTM_GETADDR, NLM_F_REQUEST | NLM_F_DUMP);
+	ndm.ndm_ifindex = neigh_ifindex(key);
 
-	if (!msg)
-		return -1;
+	if (!ndm.ndm_ifindex)
+		return;
+
+	alen = (key->data.family == AF_INET6) ? sizeof(struct in6_addr)
+	                                      : sizeof(struct in_addr);
 
-	nlmsg_append(msg, &ifa, sizeof(ifa), 0);
+	msg = nlmsg_alloc_simple(RTM_GETNEIGH, NLM_F_REQUEST);
 
-	rt_done = false;
+	if (!msg)
+		return;
+
+	if (!nlmsg_append(msg, &ndm, sizeof(ndm), 0) &&
+	    !nla_put(msg, NDA_DST, alen, &key->data.addr) &&
+	    nl_send_auto_complete(rt_event, msg) >= 0)
+		neigh_stats.queries++;
 
-	nl_cb_set(rt_cb, NL_CB_VALID, NL_CB_CUSTOM, ipaddr_parse, &query);
-	nl_send_auto_complete(rt_sock, msg);
 	nlmsg_free(msg);
+}
+
+int
+update_macaddr(int family, const void *addr)
+{
+	struct addr_entry *ae, *atmp;
+	struct link_entry *le, *ltmp;
+	struct neigh_entry *ptr;
+	union neigh_key key;
+
+	neigh_key_init(&key, family, addr);
+
+	ptr = neigh_find(&key);
+
+	/* neighbors are learned from notifications, only router local
+	 * addresses need to be resolved */
+	if (ptr && !ptr->negative)
+		return 0;
+
+	/* resolution failed recently, don't bother again */
+	if (ptr && ptr->negative > neigh_now()) {
+		neigh_stats.negative++;
+		return -ENOENT;
+	}
+
+	ae = avl_find_element(&addresses, &key, atmp, node);
+	le = ae ? avl_find_element(&links, &ae->ifindex, ltmp, node) : NULL;
+
+	if (le)
+		return neigh_store(&key, &le->mac);
 
-	while (!rt_done)
-		nl_recvmsgs(rt_sock, rt_cb);
+	/* send a single query, the negative entry suppresses further ones
+	 * until the answer arrives or the entry expires */
+	if (ptr)
+		neigh_del(ptr);
 
-	return query.ifindex;
+	if (neigh_add(&key, neigh_now() + NEIGH_NEGATIVE_TTL))
+		neigh_query(&key);
+
+	return -ENOENT;
 }
 
+void
+neigh_set_notify(neigh_notify_cb cb)
+{
+	notify_cb = cb;
+}
 
-static struct ether_addr *
-link_parse(void *msg, int len)
+static void
+handle_addr_change(struct uloop_timeout *tm)
 {
-	static struct ether_addr mac;
+	if (addr_notify_cb)
+		addr_notify_cb();
+}
 
-	struct nlattr *tb[__IFLA_MAX+1];
-	struct ifinfomsg *ifi;
-	struct nlmsghdr *hdr;
+void
+neigh_set_addr_notify(neigh_addr_notify_cb cb)
+{
+	addr_notify_cb = cb;
+	addr_tm.cb = handle_addr_change;
+}
 
-	for (hdr = msg; nlmsg_ok(hdr, len); hdr = nlmsg_next(hdr, &len)) {
-		if (hdr->nlmsg_type != RTM_NEWLINK)
-			continue;
+struct addr_entry *
+neigh_address_next(struct addr_entry *prev)
+{
+	struct addr_entry *last;
 
-		ifi = nlmsg_data(hdr);
+	if (avl_is_empty(&addresses))
+		return NULL;
 
-		if (nlmsg_parse(hdr, sizeof(*ifi), tb, __IFLA_MAX, NULL))
-			continue;
+	if (!prev)
+		return avl_first_element(&addresses, prev, node);
 
-		if (!tb[IFLA_ADDRESS])
-			continue;
+	last = avl_last_element(&addresses, last, node);
 
-		if (nla_len(tb[IFLA_ADDRESS]) > sizeof(mac))
-			continue;
+	if (prev == last)
+		return NULL;
+
+	return avl_next_element(prev, node);
+}
 
-		memset(&mac, 0, sizeof(mac));
-		memcpy(&mac, RTA_DATA(tb[IFLA_ADDRESS]), nla_len(tb[IFLA_ADDRESS]));
+int
+lookup_macaddr(int family, const void *addr, struct ether_addr *mac)
+{
+	struct neigh_entry *ptr;
+	union neigh_key key;
+
+	neigh_key_init(&key, family, addr);
+
+	ptr = neigh_find(&key);
 
-		return &mac;
+	if (!ptr || ptr->negative) {
+		neigh_stats.misses++;
+		return -ENOENT;
 	}
 
-	return NULL;
+	neigh_stats.hits++;
+	neigh_touch(ptr);
+
+	*mac = ptr->mac;
+	return 0;
 }
 
-static struct ether_addr *
-ifindex_to_macaddr(int ifindex)
+
+static int
+avl_cmp_neigh(const void *k1, const void *k2, void *ptr)
 {
-	struct ifinfomsg ifi = { .ifi_index = ifindex };
-	struct ether_addr *mac = NULL;
-	struct nl_msg *msg = NULL;
-	struct sockaddr_nl peer;
-	unsigned char *reply;
-	int len;
+	int i;
+	const union neigh_key *a = k1;
+	const union neigh_key *b = k2;
 
-	msg = nlmsg_alloc_simple(RTM_GETLINK, NLM_F_REQUEST);
+	for (i = 0; i < sizeof(a->u32) / sizeof(a->u32[0]); i++) {
+		if (a->u32[i] < b->u32[i])
+			return -1;
 
-	if (!msg)
-		return NULL;
+		if (a->u32[i] > b->u32[i])
+			return 1;
+	}
 
-	nlmsg_append(msg, &ifi, sizeof(ifi), 0);
-	nl_send_auto_complete(rt_sock, msg);
-	nlmsg_free(msg);
+	return 0;
+}
+
+static int
+avl_cmp_recent(const void *k1, const void *k2, void *ptr)
+{
+	return memcmp(k1, k2, sizeof(((struct neigh_recent *)0)->key));
+}
+
+void
+neigh_remember(const struct ether_addr *mac, const struct in6_addr *addr)
+{
+	struct neigh_recent *rh, key = { };
+	int i;
 
-	len = nl_recv(rt_sock, &peer, &reply, NULL);
+	if (!opt.collapse.recent)
+		return;
 
-	if (len > 0) {
-		mac = link_parse(reply, len);
-		free(reply);
+	key.key.mac = *mac;
+	memcpy(key.key.prefix, addr->s6_addr, sizeof(key.key.prefix));
+
+	rh = avl_find_element(&recent, &key.key, rh, node);
+
+	if (!rh) {
+		if (opt.neigh.limit && n_recent >= opt.neigh.limit)
+			recent_del(list_first_entry(&recent_lru, struct neigh_recent, lru));
+
+		rh = calloc(1, sizeof(*rh) +
+		               opt.collapse.recent * sizeof(rh->addrs[0]));
+
+		if (!rh)
+			return;
+
+		rh->key = key.key;
+		rh->node.key = &rh->key;
+		avl_insert(&recent, &rh->node);
+		list_add_tail(&rh->lru, &recent_lru);
+
+		n_recent++;
 	}
 
-	return mac;
+	rh->used = neigh_now();
+	list_move_tail(&rh->lru, &recent_lru);
+
+	/* keep the addresses ordered from most to least recently seen */
+	for (i = 0; i < rh->count; i++)
+		if (!memcmp(&rh->addrs[i], addr, sizeof(*addr)))
+			break;
+
+	if (i == rh->count && rh->count < opt.collapse.recent)
+		rh->count++;
+
+	if (i == rh->count)
+		i--;
+
+	memmove(&rh->addrs[1], &rh->addrs[0], i * sizeof(rh->addrs[0]));
+	rh->addrs[0] = *addr;
 }
 
+struct neigh_recent *
+neigh_recent_next(struct neigh_recent *prev)
+{
+	struct neigh_recent *last;
 
-int
-update_macaddr(int family, const void *addr)
+	if (avl_is_empty(&recent))
+		return NULL;
+
+	if (!prev)
+		return avl_first_element(&recent, prev, node);
+
+	last = avl_last_element(&recent, last, node);
+
+	if (prev == last)
+		return NULL;
+
+	return avl_next_element(prev, node);
+}
+
+static int
+avl_cmp_ifindex(const void *k1, const void *k2, void *ptr)
 {
-	struct neigh_entry *ptr, *tmp;
+	const int *a = k1, *b = k2;
+
+	return *a - *b;
+}
+
+static void
+neigh_parse(struct nlmsghdr *hdr)
+{
+	struct ndmsg *nd = nlmsg_data(hdr);
+	struct nlattr *tb[NDA_MAX+1];
+	struct ether_addr mac = { }, empty = { };
 	union neigh_key key = { };
-	struct ether_addr *res;
-	int ifindex;
+	int alen;
 
-	if (family == AF_INET6) {
-		key.data.family = AF_INET6;
-		key.data.addr.in6 = *(struct in6_addr *)addr;
-	}
-	else {
-		key.data.family = AF_INET;
-		key.data.addr.in.s_addr = be32toh(((struct in_addr *)addr)->s_addr);
-	}
+	/* entries removed by the kernel keep their last known MAC address */
+	if (hdr->nlmsg_type != RTM_NEWNEIGH)
+		return;
+
+	if (nd->ndm_family == AF_INET)
+		alen = sizeof(struct in_addr);
+	else if (nd->ndm_family == AF_INET6)
+		alen = sizeof(struct in6_addr);
+	else
+		return;
 
-	res = ipaddr_to_macaddr(family, &key.data.addr);
+	if (nd->ndm_state & (NUD_NOARP | NUD_FAILED | NUD_INCOMPLETE))
+		return;
 
-	if (!res) {
-		ifindex = ipaddr_to_ifindex(family, &key.data.addr);
+	if (nlmsg_parse(hdr, sizeof(*nd), tb, NDA_MAX, NULL))
+		return;
 
-		if (ifindex > 0)
-			res = ifindex_to_macaddr(ifindex);
+	if (!tb[NDA_LLADDR] || !tb[NDA_DST] || nla_len(tb[NDA_DST]) != alen)
+		return;
 
-		if (!res)
-			return -ENOENT;
-	}
+	if (nla_len(tb[NDA_LLADDR]) > sizeof(mac))
+		return;
+
+	memcpy(&mac, nla_data(tb[NDA_LLADDR]), nla_len(tb[NDA_LLADDR]));
+
+	if (!memcmp(&mac, &empty, sizeof(mac)))
+		return;
+
+	key.data.family = nd->ndm_family;
+	memcpy(&key.data.addr, nla_data(tb[NDA_DST]), alen);
+
+	neigh_store(&key, &mac);
+}
+
+static void
+addr_parse(struct nlmsghdr *hdr)
+{
+	struct ifaddrmsg *ifa = nlmsg_data(hdr);
+	struct nlattr *addr, *tb[__IFA_MAX+1];
+	struct addr_entry *ptr, *tmp;
+	union neigh_key key = { };
+	int alen;
+
+	if (ifa->ifa_family == AF_INET)
+		alen = sizeof(struct in_addr);
+	else if (ifa->ifa_family == AF_INET6)
+		alen = sizeof(struct in6_addr);
+	else
+		return;
+
+	if (nlmsg_parse(hdr, sizeof(*ifa), tb, __IFA_MAX, NULL))
+		return;
+
+	addr = tb[IFA_LOCAL] ? tb[IFA_LOCAL] : tb[IFA_ADDRESS];
+
+	if (!addr || nla_len(addr) != alen)
+		return;
+
+	key.data.family = ifa->ifa_family;
+	memcpy(&key.data.addr, nla_data(addr), alen);
 
-	ptr = avl_find_element(&neighbors, &key, tmp, node);
+	ptr = avl_find_element(&addresses, &key, tmp, node);
+
+	if (addr_notify_cb)
+		uloop_timeout_set(&addr_tm, NEIGH_ADDR_DELAY);
+
+	if (hdr->nlmsg_type == RTM_DELADDR) {
+		if (ptr) {
+			avl_delete(&addresses, &ptr->node);
+			free(ptr);
+		}
+
+		return;
+	}
 
 	if (!ptr) {
 		ptr = calloc(1, sizeof(*ptr));
 
 		if (!ptr)
-			return -ENOMEM;
+			return;
 
 		ptr->key = key;
 		ptr->node.key = &ptr->key;
 
-		avl_insert(&neighbors, &ptr->node);
+		avl_insert(&addresses, &ptr->node);
 	}
 
-	ptr->mac = *res;
-	return 0;
+	ptr->ifindex = ifa->ifa_index;
+	ptr->prefixlen = ifa->ifa_prefixlen;
+	ptr->scope = ifa->ifa_scope;
 }
 
-int
-lookup_macaddr(int family, const void *addr, struct ether_addr *mac)
+static void
+link_parse(struct nlmsghdr *hdr)
 {
-	struct neigh_entry *ptr, *tmp;
-	union neigh_key key = { };
+	struct ifinfomsg *ifi = nlmsg_data(hdr);
+	struct nlattr *tb[__IFLA_MAX+1];
+	struct link_entry *ptr, *tmp;
 
-	if (family == AF_INET6) {
-		key.data.family = AF_INET6;
-		key.data.addr.in6 = *(struct in6_addr *)addr;
+	ptr = avl_find_element(&links, &ifi->ifi_index, tmp, node);
+
+	if (hdr->nlmsg_type == RTM_DELLINK) {
+		if (ptr) {
+			avl_delete(&links, &ptr->node);
+			free(ptr);
+		}
+
+		return;
+	}
+
+	if (nlmsg_parse(hdr, sizeof(*ifi), tb, __IFLA_MAX, NULL))
+		return;
+
+	if (!tb[IFLA_ADDRESS] || nla_len(tb[IFLA_ADDRESS]) > sizeof(ptr->mac))
+		return;
+
+	if (!ptr) {
+		ptr = calloc(1, sizeof(*ptr));
+
+		if (!ptr)
+			return;
+
+		ptr->ifindex = ifi->ifi_index;
+		ptr->node.key = &ptr->ifindex;
+
+		avl_insert(&links, &ptr->node);
+	}
+
+	memset(&ptr->mac, 0, sizeof(ptr->mac));
+	memcpy(&ptr->mac, nla_data(tb[IFLA_ADDRESS]), nla_len(tb[IFLA_ADDRESS]));
+}
+
+static void
+rt_dump_next(void)
+{
+	struct ndmsg ndm = { .ndm_family = AF_UNSPEC };
+	struct ifinfomsg ifi = { .ifi_family = AF_UNSPEC };
+	struct ifaddrmsg ifa = { .ifa_family = AF_UNSPEC };
+	struct nl_msg *msg;
+	void *req;
+	int type, len;
+
+	if (rt_dumping || !rt_dumps_pending)
+		return;
+
+	if (rt_dumps_pending & RT_DUMP_NEIGH) {
+		rt_dumps_pending &= ~RT_DUMP_NEIGH;
+		type = RTM_GETNEIGH, req = &ndm, len = sizeof(ndm);
+	}
+	else if (rt_dumps_pending & RT_DUMP_LINK) {
+		rt_dumps_pending &= ~RT_DUMP_LINK;
+		type = RTM_GETLINK, req = &ifi, len = sizeof(ifi);
 	}
 	else {
-		key.data.family = AF_INET;
-		key.data.addr.in.s_addr = be32toh(((struct in_addr *)addr)->s_addr);
+		rt_dumps_pending &= ~RT_DUMP_ADDR;
+		type = RTM_GETADDR, req = &ifa, len = sizeof(ifa);
 	}
 
-	ptr = avl_find_element(&neighbors, &key, tmp, node);
+	msg = nlmsg_alloc_simple(type, NLM_F_REQUEST | NLM_F_DUMP);
 
-	if (!ptr)
-		return -ENOENT;
+	if (!msg)
+		return;
 
-	*mac = ptr->mac;
-	return 0;
-}
+	nlmsg_append(msg, req, len, 0);
 
+	if (nl_send_auto_complete(rt_event, msg) >= 0) {
+		rt_dump_seq = nlmsg_hdr(msg)->nlmsg_seq;
+		rt_dumping = true;
+	}
 
-static int
-avl_cmp_neigh(const void *k1, const void *k2, void *ptr)
+	nlmsg_free(msg);
+}
+
+static void
+rt_dump(unsigned int what)
 {
-	int i;
-	const union neigh_key *a = k1;
-	const union neigh_key *b = k2;
+	rt_dumps_pending |= what;
+	rt_dump_next();
+}
 
-	for (i = 0; i < sizeof(a->u32) / sizeof(a->u32[0]); i++) {
-		if (a->u32[i] < b->u32[i])
-			return -1;
+static void
+handle_rt_event(struct uloop_fd *fd, unsigned int ev)
+{
+	struct nlmsghdr *hdr;
+	int len;
 
-		if (a->u32[i] > b->u32[i])
-			return 1;
+	while (true) {
+		len = recv(fd->fd, rt_buf, sizeof(rt_buf), MSG_DONTWAIT);
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* notifications got lost, resync the caches */
+			if (errno == ENOBUFS) {
+				rt_dump(RT_DUMP_ALL);
+				continue;
+			}
+
+			break;
+		}
+
+		for (hdr = (struct nlmsghdr *)rt_buf;
+		     nlmsg_ok(hdr, len);
+		     hdr = nlmsg_next(hdr, &len)) {
+			switch (hdr->nlmsg_type) {
+			case NLMSG_DONE:
+			case NLMSG_ERROR:
+				if (hdr->nlmsg_seq != rt_dump_seq)
+					break;
+
+				rt_dumping = false;
+				rt_dump_next();
+				break;
+
+			case RTM_NEWNEIGH:
+			case RTM_DELNEIGH:
+				neigh_parse(hdr);
+				break;
+
+			case RTM_NEWLINK:
+			case RTM_DELLINK:
+				link_parse(hdr);
+				break;
+
+			case RTM_NEWADDR:
+			case RTM_DELADDR:
+				addr_parse(hdr);
+				break;
+			}
+		}
 	}
-
-	return 0;
 }
 
-__attribute__((constructor)) static void init_neighbors(void)
+int
+init_neighbors(void)
 {
-	rt_connect();
-	avl_init(&neighbors, avl_cmp_neigh, false, NULL);
+	if (neigh_grow())
+		return -ENOMEM;
+
+	avl_init(&addresses, avl_cmp_neigh, false, NULL);
+	avl_init(&recent, avl_cmp_recent, false, NULL);
+	avl_init(&links, avl_cmp_ifindex, false, NULL);
+
+	rt_event = nl_socket_alloc();
+
+	if (!rt_event)
+		return -ENOMEM;
+
+	if (nl_connect(rt_event, NETLINK_ROUTE) ||
+	    nl_socket_add_memberships(rt_event, RTNLGRP_NEIGH, RTNLGRP_LINK,
+	                              RTNLGRP_IPV4_IFADDR, RTNLGRP_IPV6_IFADDR, 0))
+		return -EIO;
+
+	rt_fd.cb = handle_rt_event;
+	rt_fd.fd = nl_socket_get_fd(rt_event);
+
+	if (uloop_fd_add(&rt_fd, ULOOP_READ))
+		return -errno;
+
+	rt_dump(RT_DUMP_ALL);
+
+	if (opt.neigh.timeout) {
+		aging_tm.cb = handle_aging;
+		uloop_timeout_set(&aging_tm, NEIGH_AGING_INTERVAL);
+	}
+
+	return 0;
 }
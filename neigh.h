@@ -16,6 +16,11 @@
   PERFORMANCE OF THIS SOFTWARE.
 */
 
+#include <time.h>
+
+#include <libubox/avl.h>
+#include <libubox/list.h>
+
 #include <netinet/in.h>
 #include <net/ethernet.h>
 
@@ -33,8 +38,56 @@ union neigh_key {
 struct neigh_entry {
 	union neigh_key key;
 	struct ether_addr mac;
+	time_t negative;
+	time_t used;
+	struct neigh_entry *next;
+	struct list_head lru;
+};
+
+/* local interface address */
+struct addr_entry {
+	union neigh_key key;
+	int ifindex;
+	uint8_t prefixlen;
+	uint8_t scope;
+	struct avl_node node;
+};
+
+/* recently seen full addresses of an IPv6 host collapsed to its prefix */
+struct neigh_recent {
 	struct avl_node node;
+	struct list_head lru;
+	time_t used;
+	struct {
+		struct ether_addr mac;
+		uint8_t prefix[8];
+	} key;
+	uint8_t count;
+	struct in6_addr addrs[];
+};
+
+struct neigh_stats {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t negative;
+	uint64_t queries;
+	uint64_t entries;
+	uint64_t evictions;
 };
 
+extern struct neigh_stats neigh_stats;
+
+typedef void (*neigh_notify_cb)(int family, const void *addr);
+typedef void (*neigh_addr_notify_cb)(void);
+
+int init_neighbors(void);
+void neigh_set_notify(neigh_notify_cb cb);
+void neigh_set_addr_notify(neigh_addr_notify_cb cb);
+
+struct addr_entry *neigh_address_next(struct addr_entry *prev);
+
 int update_macaddr(int family, const void *addr);
 int lookup_macaddr(int family, const void *addr, struct ether_addr *mac);
+
+void neigh_remember(const struct ether_addr *mac, const struct in6_addr *addr);
+struct neigh_recent *neigh_recent_next(struct neigh_recent *prev);
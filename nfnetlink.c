@@ -19,62 +19,225 @@
 
 #include <stdio.h>
 #include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
 #include <errno.h>
+#include <endian.h>
+#include <poll.h>
+#include <pthread.h>
+#include <signal.h>
+
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <linux/sock_diag.h>
 
 #include <netlink/netlink.h>
 #include <netlink/genl/genl.h>
 #include <linux/netfilter/nfnetlink_conntrack.h>
 
+#include <libubox/avl.h>
+#include <libubox/list.h>
 #include <libubox/uloop.h>
 
 #include "nfnetlink.h"
 #include "database.h"
 #include "protocol.h"
 #include "subnets.h"
+#include "filter.h"
 #include "neigh.h"
 
 
-static uint32_t n_pending_inserts = 0;
+#define NFNL_BATCH_SIZE 32
+#define NFNL_BUFFER_SIZE 4096
+#define NFNL_DUMP_BUFFER_SIZE 32768
+
+#define NFNL_RING_SIZE 4096
+
+#define NFNL_AGG_SIZE 256
+#define NFNL_AGG_LIMIT 192
+
+#define NFNL_RESYNC_DELAY 1000
+
+#define NFNL_INSERT_DELAY 500
+#define NFNL_INSERT_POOL 4096
+
+#define NFNL_SCALE_INTERVAL 10000
+#define NFNL_SCALE_IDLE 30
+
 static struct nl_sock *nl = NULL;
+static struct nl_sock *dump_nl = NULL;
 static struct uloop_fd ufd = { };
+static struct uloop_timeout resync_tm = { };
+static uint64_t resync_time = 0;
+static uint64_t dump_time = 0;
+static uint32_t sock_drops = 0;
+
+static struct uloop_timeout scale_tm = { };
+static int buf_size = 0, buf_min = 0, buf_max = 0;
+static uint32_t buf_peak = 0;
+static int buf_idle = 0;
+
+struct budget {
+	uint32_t msgs;
+	uint64_t deadline;
+};
+
+static struct uloop_fd dump_fd = { };
+static unsigned char dump_buf[NFNL_DUMP_BUFFER_SIZE];
+static bool filter_supported = true;
+
+static struct {
+	bool running;
+	bool allow_insert;
+	uint32_t seq;
+	nfnetlink_dump_cb cb;
+	bool pending;
+	bool pending_insert;
+	nfnetlink_dump_cb pending_cb;
+	int slices;
+	int slice_err;
+	int err;
+} dump = { };
+
+static struct mmsghdr rx_msgs[NFNL_BATCH_SIZE];
+static struct iovec rx_iovs[NFNL_BATCH_SIZE];
+static unsigned char rx_bufs[NFNL_BATCH_SIZE][NFNL_BUFFER_SIZE];
+
+struct nfnetlink_stats nfnl_stats = { };
+
+/* counters updated by the ingest and dump threads, read by the main loop */
+#define stats_add(field, n) \
+	__atomic_fetch_add(&nfnl_stats.field, (n), __ATOMIC_RELAXED)
+
+struct ct_tuple {
+	struct in6_addr saddr;
+	struct in6_addr daddr;
+	uint16_t src_port;
+	uint16_t dst_port;
+	uint8_t proto;
+};
+
+struct ct_counters {
+	uint64_t pkts;
+	uint64_t bytes;
+};
 
-static struct nla_policy ct_tuple_policy[CTA_TUPLE_MAX+1] = {
-	[CTA_TUPLE_IP]          = { .type = NLA_NESTED },
-	[CTA_TUPLE_PROTO]       = { .type = NLA_NESTED },
+struct ct_flow {
+	uint8_t family;
+	uint16_t zone;
+	uint32_t mark;
+	struct ct_tuple orig;
+	struct ct_tuple reply;
+	struct ct_counters orig_ctr;
+	struct ct_counters reply_ctr;
 };
 
-static struct nla_policy ct_ip_policy[CTA_IP_MAX+1] = {
-	[CTA_IP_V4_SRC]         = { .type = NLA_U32 },
-	[CTA_IP_V4_DST]         = { .type = NLA_U32 },
-	[CTA_IP_V6_SRC]         = { .minlen = 16 },
-	[CTA_IP_V6_DST]         = { .minlen = 16 },
+struct ct_event {
+	bool allow_insert;
+	bool update_mac;
+	struct ct_flow flow;
 };
 
-static struct nla_policy ct_proto_policy[CTA_PROTO_MAX+1] = {
-	[CTA_PROTO_NUM]         = { .type = NLA_U8 },
-	[CTA_PROTO_SRC_PORT]    = { .type = NLA_U16 },
-	[CTA_PROTO_DST_PORT]    = { .type = NLA_U16 },
-	[CTA_PROTO_ICMP_ID]     = { .type = NLA_U16 },
-	[CTA_PROTO_ICMP_TYPE]   = { .type = NLA_U8 },
-	[CTA_PROTO_ICMP_CODE]   = { .type = NLA_U8 },
-	[CTA_PROTO_ICMPV6_ID]   = { .type = NLA_U16 },
-	[CTA_PROTO_ICMPV6_TYPE] = { .type = NLA_U8 },
-	[CTA_PROTO_ICMPV6_CODE] = { .type = NLA_U8 },
+/* single producer, single consumer ring passing decoded events from the
+ * ingest or dump threads to the main loop, head and tail are free running */
+struct ct_ring {
+	uint32_t head __attribute__((aligned(64)));
+	uint32_t tail __attribute__((aligned(64)));
+	uint32_t overflows;
+	struct ct_event events[NFNL_RING_SIZE];
 };
 
-static struct nla_policy ct_counters_policy[CTA_COUNTERS_MAX+1] = {
-	[CTA_COUNTERS_PACKETS]  = { .type = NLA_U64 },
-	[CTA_COUNTERS_BYTES]    = { .type = NLA_U64 },
-	[CTA_COUNTERS32_PACKETS]= { .type = NLA_U32 },
-	[CTA_COUNTERS32_BYTES]  = { .type = NLA_U32 },
+static struct ct_ring *ring = NULL;
+static struct uloop_fd ring_fd = { };
+static uint32_t ring_overflows = 0;
+static pthread_t ingest_thread;
+
+/* conntrack table slice dumped by a worker thread over its own socket */
+struct dump_slice {
+	uint8_t family;
+	bool active;
+	bool done;
+	int err;
+	uint32_t seq;
+	pthread_t thread;
+	struct nl_sock *sock;
+	struct ct_ring *ring;
+	struct uloop_fd fd;
+	unsigned char buf[NFNL_DUMP_BUFFER_SIZE];
 };
 
+static struct dump_slice *slices[2] = { };
+static int n_slices = 0;
+
+
+/* records of the current batch, coalesced by key before being merged into
+ * the database, slots index the dense record array starting from 1 */
+static struct record agg_recs[NFNL_AGG_LIMIT];
+static uint16_t agg_slots[NFNL_AGG_SIZE];
+static int n_agg = 0;
+
 
 struct delayed_record {
-	struct uloop_timeout timeout;
+	struct list_head list;
 	struct record record;
 };
 
+/* pending inserts are grouped by source address, so that a single MAC
+ * address resolution serves all queued records of a host */
+struct delayed_host {
+	struct list_head list;
+	struct avl_node node;
+	uint64_t expires;
+	uint8_t family;
+	struct in6_addr addr;
+	struct list_head records;
+};
+
+/* all inserts are delayed by the same amount of time, so a FIFO served by
+ * a single timer keeps the hosts ordered by expiry */
+static LIST_HEAD(delayed_hosts);
+
+/* entries are taken from pools growing in chunks on demand up to the
+ * database limit, to avoid gobbling up too much memory; the pools are
+ * never shrunk */
+static LIST_HEAD(free_records);
+static LIST_HEAD(free_hosts);
+static uint32_t pool_size = 0;
+
+static int
+delayed_host_cmp(const void *k1, const void *k2, void *ptr)
+{
+	const struct delayed_host *h1 = k1, *h2 = k2;
+
+	if (h1->family != h2->family)
+		return h1->family - h2->family;
+
+	return memcmp(&h1->addr, &h2->addr, sizeof(h1->addr));
+}
+
+static struct avl_tree delayed_index;
+
+static void
+database_insert_delayed_cb(struct uloop_timeout *t);
+
+static struct uloop_timeout delayed_tm = { .cb = database_insert_delayed_cb };
+
+static uint64_t
+now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint64_t
+now_ms(void)
+{
+	return now_us() / 1000;
+}
+
 static void
 database_insert_immediately(struct record *r)
 {
@@ -84,433 +247,1574 @@ database_insert_immediately(struct record *r)
 		database_update(gdbh, r);
 }
 
+/* account IPv6 hosts by MAC address and /64 prefix, so that rotating
+ * temporary addresses do not create a new set of records each */
 static void
-database_insert_delayed_cb(struct uloop_timeout *t)
+collapse_addr(struct record *r)
+{
+	if (!opt.collapse.enabled || r->family != AF_INET6)
+		return;
+
+	neigh_remember(&r->src_mac.ea, &r->src_addr.in6);
+
+	r->src_addr.in6.s6_addr32[2] = 0;
+	r->src_addr.in6.s6_addr32[3] = 0;
+}
+
+static void
+delayed_host_flush(struct delayed_host *dh)
 {
+	struct delayed_record *dr, *tmp;
+	struct ether_addr ea = { };
 	int err;
-	struct delayed_record *dr;
 
-	dr = container_of(t, struct delayed_record, timeout);
-	err = update_macaddr(dr->record.family, &dr->record.src_addr.in6);
+	/* unlink first, resolving might trigger a notification for it */
+	avl_delete(&delayed_index, &dh->node);
+
+	err = update_macaddr(dh->family, &dh->addr);
 
 	if (err == 0)
-		lookup_macaddr(dr->record.family, &dr->record.src_addr.in6,
-		               &dr->record.src_mac.ea);
+		err = lookup_macaddr(dh->family, &dh->addr, &ea);
+
+	list_for_each_entry_safe(dr, tmp, &dh->records, list) {
+		if (err == 0) {
+			dr->record.src_mac.ea = ea;
+			collapse_addr(&dr->record);
+		}
 
-	database_insert_immediately(&dr->record);
-	free(dr);
+		database_insert_immediately(&dr->record);
+		list_move(&dr->list, &free_records);
+	}
 
-	if (n_pending_inserts > 0)
-		n_pending_inserts--;
+	list_move(&dh->list, &free_hosts);
 }
 
-static int
-database_insert_delayed(struct record *r)
+static void
+database_insert_delayed_cb(struct uloop_timeout *t)
 {
-	struct delayed_record *dr;
+	struct delayed_host *dh, *tmp;
+	uint64_t now = now_ms();
 
-	/* to avoid gobbling up too much memory, tie the maximum allowed number
-	 * of pending insertions to the configured database limit */
-	if (opt.db.limit > 0 && n_pending_inserts >= opt.db.limit) {
-		fprintf(stderr, "Too many pending MAC address lookups\n");
-		database_insert_immediately(r);
-		return -ENOSPC;
-	}
+	list_for_each_entry_safe(dh, tmp, &delayed_hosts, list) {
+		if (dh->expires > now) {
+			uloop_timeout_set(t, dh->expires - now);
+			break;
+		}
 
-	dr = calloc(1, sizeof(*dr));
+		delayed_host_flush(dh);
+	}
+}
 
-	if (!dr)
-		return -ENOMEM;
+/* a neighbor got resolved, insert the records waiting for it right away */
+static void
+handle_neigh_notify(int family, const void *addr)
+{
+	struct delayed_host *dh, key = { .family = family };
 
-	dr->record = *r;
-	dr->timeout.cb = database_insert_delayed_cb;
+	if (!pool_size)
+		return;
 
-	n_pending_inserts++;
+	memcpy(&key.addr, addr, sizeof(key.addr));
+	dh = avl_find_element(&delayed_index, &key, dh, node);
 
-	return uloop_timeout_set(&dr->timeout, 500) ? -EEXIST : 0;
+	if (dh)
+		delayed_host_flush(dh);
 }
 
-static bool
-parse_addrs(struct nlattr **tuple, uint8_t *family, void *saddr, void *daddr)
+static int
+grow_delayed_pool(void)
 {
-	struct nlattr *addrs[CTA_IP_MAX + 1];
+	uint32_t i, size = NFNL_INSERT_POOL;
+	struct delayed_record *records;
+	struct delayed_host *hosts;
 
-	if (nla_parse_nested(addrs, CTA_IP_MAX, tuple[CTA_TUPLE_IP], ct_ip_policy))
-		return false;
+	if (opt.db.limit) {
+		if (pool_size >= opt.db.limit)
+			return -ENOSPC;
 
-	if (addrs[CTA_IP_V4_SRC] && addrs[CTA_IP_V4_DST]) {
-		*family = AF_INET;
-		((struct in_addr *)saddr)->s_addr = htobe32(nla_get_u32(addrs[CTA_IP_V4_SRC]));
-		((struct in_addr *)daddr)->s_addr = htobe32(nla_get_u32(addrs[CTA_IP_V4_DST]));
-		return true;
+		if (size > opt.db.limit - pool_size)
+			size = opt.db.limit - pool_size;
 	}
-	else if (addrs[CTA_IP_V6_SRC] && addrs[CTA_IP_V6_DST]) {
-		*family = AF_INET6;
-		nla_memcpy(saddr, addrs[CTA_IP_V6_SRC], 16);
-		nla_memcpy(daddr, addrs[CTA_IP_V6_DST], 16);
-		return true;
+
+	records = calloc(size, sizeof(*records));
+	hosts = calloc(size, sizeof(*hosts));
+
+	if (!records || !hosts) {
+		free(records);
+		free(hosts);
+		return -ENOMEM;
 	}
 
-	return false;
+	for (i = 0; i < size; i++) {
+		list_add_tail(&records[i].list, &free_records);
+		list_add_tail(&hosts[i].list, &free_hosts);
+	}
+
+	if (!pool_size)
+		avl_init(&delayed_index, delayed_host_cmp, false, NULL);
+
+	pool_size += size;
+
+	return 0;
 }
 
-static bool
-parse_proto_port(struct nlattr **tuple, bool src, uint8_t *proto, uint16_t *port)
+static void
+agg_flush(void)
 {
-	struct nlattr *tb[CTA_PROTO_MAX + 1];
+	int i;
 
-	*proto = 0;
-	*port = 0;
+	if (!n_agg)
+		return;
 
-	if (nla_parse_nested(tb, CTA_PROTO_MAX, tuple[CTA_TUPLE_PROTO], ct_proto_policy))
-		return false;
+	for (i = 0; i < n_agg; i++)
+		database_insert_immediately(&agg_recs[i]);
+
+	nfnl_stats.agg_out += n_agg;
 
-	if (tb[CTA_PROTO_NUM]) {
-		*proto = nla_get_u8(tb[CTA_PROTO_NUM]);
+	memset(agg_slots, 0, sizeof(agg_slots));
+	n_agg = 0;
+}
 
-		if (tb[src ? CTA_PROTO_SRC_PORT : CTA_PROTO_DST_PORT])
-			*port = nla_get_u16(tb[src ? CTA_PROTO_SRC_PORT : CTA_PROTO_DST_PORT]);
+static uint32_t
+agg_hash(const struct record *r)
+{
+	const uint32_t *p = (const uint32_t *)r;
+	uint32_t i, h = 0x811c9dc5;
 
-		return true;
-	}
+	for (i = 0; i < offsetof(struct record, count) / sizeof(*p); i++)
+		h = (h ^ p[i]) * 0x01000193;
 
-	return false;
+	return h ^ (h >> 16);
 }
 
 static void
-parse_event(void *reply, int len, bool allow_insert, bool update_mac)
+agg_add(struct record *r)
 {
-	int err;
-	struct nlmsghdr *hdr;
-	struct genlmsghdr *gnlh;
-	static struct nlattr *attr[__CTA_MAX + 1];
-	static struct nlattr *tuple[CTA_TUPLE_MAX + 1];
-	static struct nlattr *counters[CTA_COUNTERS_MAX + 1];
-
-	struct record r = { };
-	struct in6_addr orig_saddr, orig_daddr, reply_saddr, reply_daddr;
-
-	uint64_t orig_pkts, orig_bytes, reply_pkts, reply_bytes;
-	uint16_t orig_port, reply_port;
-	uint8_t orig_proto, reply_proto;
-
-	for (hdr = reply; nlmsg_ok(hdr, len); hdr = nlmsg_next(hdr, &len)) {
-		gnlh = nlmsg_data(hdr);
-		orig_pkts = 0;
-		orig_bytes = 0;
-		reply_pkts = 0;
-		reply_bytes = 0;
-		memset(&r, 0, sizeof(r));
-		memset(&orig_saddr, 0, sizeof(orig_saddr));
-		memset(&orig_daddr, 0, sizeof(orig_daddr));
-		memset(&reply_saddr, 0, sizeof(reply_saddr));
-		memset(&reply_daddr, 0, sizeof(reply_daddr));
-
-		if (nla_parse(attr, __CTA_MAX, genlmsg_attrdata(nlmsg_data(hdr), 0),
-				      genlmsg_attrlen(gnlh, 0), NULL))
-			continue;
-
-		if (!attr[CTA_TUPLE_ORIG] ||
-		    nla_parse_nested(tuple, CTA_TUPLE_MAX, attr[CTA_TUPLE_ORIG], ct_tuple_policy))
-			continue;
+	struct record *p;
+	uint32_t i;
 
-		if (!parse_addrs(tuple, &r.family, &orig_saddr, &orig_daddr) ||
-		    !parse_proto_port(tuple, false, &orig_proto, &orig_port))
-			continue;
+	if (n_agg >= NFNL_AGG_LIMIT)
+		agg_flush();
 
-		if (!attr[CTA_TUPLE_REPLY] ||
-		    nla_parse_nested(tuple, CTA_TUPLE_MAX, attr[CTA_TUPLE_REPLY], ct_tuple_policy))
-			continue;
+	nfnl_stats.agg_in++;
 
-		if (!parse_addrs(tuple, &r.family, &reply_saddr, &reply_daddr) ||
-		    !parse_proto_port(tuple, true, &reply_proto, &reply_port))
-			continue;
+	for (i = agg_hash(r); ; i++) {
+		i %= NFNL_AGG_SIZE;
 
-		if (attr[CTA_COUNTERS_ORIG] &&
-		    !nla_parse_nested(counters, CTA_COUNTERS_MAX, attr[CTA_COUNTERS_ORIG], ct_counters_policy)) {
-			orig_pkts = nla_get_u64(counters[CTA_COUNTERS_PACKETS]);
-			orig_bytes = nla_get_u64(counters[CTA_COUNTERS_BYTES]);
+		if (!agg_slots[i]) {
+			agg_recs[n_agg++] = *r;
+			agg_slots[i] = n_agg;
+			return;
 		}
 
-		if (attr[CTA_COUNTERS_REPLY] &&
-		    !nla_parse_nested(counters, CTA_COUNTERS_MAX, attr[CTA_COUNTERS_REPLY], ct_counters_policy)) {
-			reply_pkts = nla_get_u64(counters[CTA_COUNTERS_PACKETS]);
-			reply_bytes = nla_get_u64(counters[CTA_COUNTERS_BYTES]);
-		}
+		p = &agg_recs[agg_slots[i] - 1];
 
-		/* local -> remote */
-		if (!match_subnet(r.family, &orig_saddr) && match_subnet(r.family, &orig_daddr)) {
-			r.proto = orig_proto;
-			r.dst_port = orig_port;
-			r.in_pkts = reply_pkts;
-			r.in_bytes = reply_bytes;
-			r.out_pkts = orig_pkts;
-			r.out_bytes = orig_bytes;
-			r.src_addr.in6 = orig_saddr;
+		if (!memcmp(p, r, offsetof(struct record, count))) {
+			add64(p->count, r->count);
+			add64(p->in_pkts, r->in_pkts);
+			add64(p->in_bytes, r->in_bytes);
+			add64(p->out_pkts, r->out_pkts);
+			add64(p->out_bytes, r->out_bytes);
+			return;
 		}
+	}
+}
 
-		/* remote -> local */
-		else if (!match_subnet(r.family, &reply_saddr) && match_subnet(r.family, &reply_daddr)) {
-			r.proto = reply_proto;
-			r.dst_port = reply_port;
-			r.in_pkts = orig_pkts;
-			r.in_bytes = orig_bytes;
-			r.out_pkts = reply_pkts;
-			r.out_bytes = reply_bytes;
-			r.src_addr.in6 = reply_saddr;
-		}
+static int
+database_insert_delayed(struct record *r)
+{
+	struct delayed_host *dh, key = { .family = r->family };
+	struct delayed_record *dr;
 
-		/* local -> local or remote -> remote */
-		else {
-			continue;
+	if (!pool_size && grow_delayed_pool())
+		goto full;
+
+	key.addr = r->src_addr.in6;
+	dh = avl_find_element(&delayed_index, &key, dh, node);
+
+	/* merge with a record of identical key queued meanwhile */
+	if (dh) {
+		list_for_each_entry(dr, &dh->records, list) {
+			if (!memcmp(&dr->record, r, offsetof(struct record, count))) {
+				add64(dr->record.count, r->count);
+				add64(dr->record.in_pkts, r->in_pkts);
+				add64(dr->record.in_bytes, r->in_bytes);
+				add64(dr->record.out_pkts, r->out_pkts);
+				add64(dr->record.out_bytes, r->out_bytes);
+				return 0;
+			}
 		}
+	}
 
-		if (!lookup_protocol(r.proto, be16toh(r.dst_port))) {
-			r.proto = 0;
-			r.dst_port = 0;
-		}
+	if ((list_empty(&free_records) || (!dh && list_empty(&free_hosts))) &&
+	    grow_delayed_pool())
+		goto full;
+
+	if (!dh) {
+		dh = list_first_entry(&free_hosts, struct delayed_host, list);
+		dh->family = r->family;
+		dh->addr = r->src_addr.in6;
+		dh->expires = now_ms() + NFNL_INSERT_DELAY;
+		dh->node.key = dh;
+
+		INIT_LIST_HEAD(&dh->records);
+		list_move_tail(&dh->list, &delayed_hosts);
+		avl_insert(&delayed_index, &dh->node);
+	}
 
-		r.count = htobe64(allow_insert);
+	dr = list_first_entry(&free_records, struct delayed_record, list);
+	dr->record = *r;
 
-		if (update_mac)
-			update_macaddr(r.family, &r.src_addr.in6);
+	list_move_tail(&dr->list, &dh->records);
 
-		err = lookup_macaddr(r.family, &r.src_addr.in6, &r.src_mac.ea);
+	if (!delayed_tm.pending)
+		uloop_timeout_set(&delayed_tm, NFNL_INSERT_DELAY);
 
-		if (update_mac && err == -ENOENT)
-			database_insert_delayed(&r);
-		else
-			database_insert_immediately(&r);
-	}
+	return 0;
+
+full:
+	/* account the record right away, without waiting for its MAC */
+	nfnl_stats.insert_overflows++;
+	database_insert_immediately(r);
+	return -ENOSPC;
 }
 
-static void
-handle_event(struct uloop_fd *fd, unsigned int ev)
+static bool
+decode_addrs(struct nlattr *nest, uint8_t *family, struct ct_tuple *tuple)
 {
-	struct sockaddr_nl peer;
-	struct nlmsghdr *hdr;
-	unsigned char *msg;
-	bool is_new;
-	int len;
+	struct nlattr *attr;
+	uint32_t *a;
+	int rem, seen = 0;
 
-	database_archive(gdbh);
+	nla_for_each_nested(attr, nest, rem) {
+		switch (nla_type(attr)) {
+		case CTA_IP_V4_SRC:
+		case CTA_IP_V4_DST:
+			if (nla_len(attr) < sizeof(uint32_t))
+				return false;
 
-	while (true) {
-		len = nl_recv(nl, &peer, &msg, NULL);
+			a = (nla_type(attr) == CTA_IP_V4_SRC)
+				? tuple->saddr.s6_addr32 : tuple->daddr.s6_addr32;
+
+			a[0] = htobe32(nla_get_u32(attr));
+			a[1] = a[2] = a[3] = 0;
 
-		if (len <= 0)
+			*family = AF_INET;
+			seen |= (nla_type(attr) == CTA_IP_V4_SRC) ? 1 : 2;
 			break;
 
-		hdr = (struct nlmsghdr *)msg;
-		is_new = (NFNL_MSG_TYPE(hdr->nlmsg_type) == IPCTNL_MSG_CT_NEW);
-		parse_event(msg, len, is_new, is_new);
-		free(msg);
+		case CTA_IP_V6_SRC:
+		case CTA_IP_V6_DST:
+			if (nla_len(attr) < sizeof(struct in6_addr))
+				return false;
+
+			memcpy((nla_type(attr) == CTA_IP_V6_SRC)
+				? &tuple->saddr : &tuple->daddr,
+			       nla_data(attr), sizeof(struct in6_addr));
+
+			*family = AF_INET6;
+			seen |= (nla_type(attr) == CTA_IP_V6_SRC) ? 1 : 2;
+			break;
+		}
 	}
-}
 
-static int
-handle_dump(struct nl_msg *msg, void *arg)
-{
-	struct nlmsghdr *hdr = nlmsg_hdr(msg);
-	bool *allow_insert = arg;
-	parse_event(hdr, hdr->nlmsg_len, *allow_insert, true);
-	return NL_SKIP;
+	return (seen == 3);
 }
 
-static int
-handle_error(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg)
+static bool
+decode_proto(struct nlattr *nest, struct ct_tuple *tuple)
 {
-	int *ret = arg;
-	*ret = err->error;
-	return NL_STOP;
-}
+	struct nlattr *attr;
+	bool seen = false;
+	int rem;
 
-static int
-handle_finish(struct nl_msg *msg, void *arg)
-{
-	int *ret = arg;
-	*ret = 0;
-	return NL_SKIP;
-}
+	tuple->src_port = 0;
+	tuple->dst_port = 0;
 
-static int
-handle_ack(struct nl_msg *msg, void *arg)
-{
-	int *ret = arg;
-	*ret = 0;
-	return NL_STOP;
+	nla_for_each_nested(attr, nest, rem) {
+		switch (nla_type(attr)) {
+		case CTA_PROTO_NUM:
+			if (nla_len(attr) < sizeof(uint8_t))
+				return false;
+
+			tuple->proto = nla_get_u8(attr);
+			seen = true;
+			break;
+
+		case CTA_PROTO_SRC_PORT:
+			if (nla_len(attr) >= sizeof(uint16_t))
+				tuple->src_port = nla_get_u16(attr);
+			break;
+
+		case CTA_PROTO_DST_PORT:
+			if (nla_len(attr) >= sizeof(uint16_t))
+				tuple->dst_port = nla_get_u16(attr);
+			break;
+		}
+	}
+
+	return seen;
 }
 
-static int
-handle_seq(struct nl_msg *msg, void *arg)
+static bool
+decode_tuple(struct nlattr *nest, uint8_t *family, struct ct_tuple *tuple)
 {
-	return NL_OK;
+	struct nlattr *attr;
+	int rem, seen = 0;
+
+	nla_for_each_nested(attr, nest, rem) {
+		switch (nla_type(attr)) {
+		case CTA_TUPLE_IP:
+			if (!decode_addrs(attr, family, tuple))
+				return false;
+
+			seen |= 1;
+			break;
+
+		case CTA_TUPLE_PROTO:
+			if (!decode_proto(attr, tuple))
+				return false;
+
+			seen |= 2;
+			break;
+		}
+	}
+
+	return (seen == 3);
 }
 
 static void
-check_rmem_max(int bufsize)
+decode_counters(struct nlattr *nest, struct ct_counters *ctr)
 {
-	char buf[16];
-	int max = 0;
-	FILE *f;
+	struct nlattr *attr;
+	int rem;
+
+	nla_for_each_nested(attr, nest, rem) {
+		switch (nla_type(attr)) {
+		case CTA_COUNTERS_PACKETS:
+			if (nla_len(attr) >= sizeof(uint64_t))
+				ctr->pkts = nla_get_u64(attr);
+			break;
 
-	f = fopen("/proc/sys/net/core/rmem_max", "r");
+		case CTA_COUNTERS_BYTES:
+			if (nla_len(attr) >= sizeof(uint64_t))
+				ctr->bytes = nla_get_u64(attr);
+			break;
 
-	if (f) {
-		if (fgets(buf, sizeof(buf), f))
-			max = atoi(buf);
+		/* 32bit counters are sent by older kernels, convert them into
+		 * the big endian 64bit representation used by the database */
+		case CTA_COUNTERS32_PACKETS:
+			if (nla_len(attr) >= sizeof(uint32_t))
+				ctr->pkts = htobe64(be32toh(nla_get_u32(attr)));
+			break;
 
-		fclose(f);
+		case CTA_COUNTERS32_BYTES:
+			if (nla_len(attr) >= sizeof(uint32_t))
+				ctr->bytes = htobe64(be32toh(nla_get_u32(attr)));
+			break;
+		}
 	}
-
-	if (bufsize > max)
-		fprintf(stderr,
-		        "The netlink receive buffer size of %d bytes will be capped to %d bytes\n"
-		        "by the kernel. The net.core.rmem_max sysctl limit needs to be raised to\n"
-		        "at least %d in order to sucessfully set the desired receive buffer size!\n",
-		        bufsize, max, bufsize);
 }
 
-
-int
-nfnetlink_connect(int bufsize)
+static bool
+decode_event(struct nlmsghdr *hdr, struct ct_flow *flow)
 {
-	nl = nl_socket_alloc();
+	struct nlattr *attr;
+	int rem, seen = 0;
 
-	if (!nl)
-		return -ENOMEM;
+	if (NFNL_SUBSYS_ID(hdr->nlmsg_type) != NFNL_SUBSYS_CTNETLINK)
+		return false;
 
-	if (nl_connect(nl, NETLINK_NETFILTER))
-		return -errno;
+	flow->zone = 0;
+	flow->mark = 0;
+	flow->orig_ctr.pkts = 0;
+	flow->orig_ctr.bytes = 0;
+	flow->reply_ctr.pkts = 0;
+	flow->reply_ctr.bytes = 0;
 
-	if (nl_socket_add_memberships(nl, NFNLGRP_CONNTRACK_NEW,
-	                                  NFNLGRP_CONNTRACK_DESTROY, 0))
-		return -errno;
+	nlmsg_for_each_attr(attr, hdr, sizeof(struct nfgenmsg), rem) {
+		switch (nla_type(attr)) {
+		case CTA_TUPLE_ORIG:
+			if (!decode_tuple(attr, &flow->family, &flow->orig))
+				return false;
 
-	check_rmem_max(bufsize);
+			seen |= 1;
+			break;
 
-	if (nl_socket_set_buffer_size(nl, bufsize, 0))
-		return -errno;
+		case CTA_TUPLE_REPLY:
+			if (!decode_tuple(attr, &flow->family, &flow->reply))
+				return false;
 
-	ufd.cb = handle_event;
-	ufd.fd = nl_socket_get_fd(nl);
+			seen |= 2;
+			break;
 
-	if (uloop_fd_add(&ufd, ULOOP_READ))
-		return -errno;
+		case CTA_COUNTERS_ORIG:
+			decode_counters(attr, &flow->orig_ctr);
+			break;
 
-	return 0;
+		case CTA_COUNTERS_REPLY:
+			decode_counters(attr, &flow->reply_ctr);
+			break;
+
+		case CTA_MARK:
+			if (nla_len(attr) >= sizeof(uint32_t))
+				flow->mark = be32toh(nla_get_u32(attr));
+			break;
+
+		case CTA_ZONE:
+			if (nla_len(attr) >= sizeof(uint16_t))
+				flow->zone = be16toh(nla_get_u16(attr));
+			break;
+		}
+	}
+
+	return (seen == 3);
 }
 
-int
-nfnetlink_dump(bool allow_insert)
+/* kernels lacking support for some dump filter attributes silently ignore
+ * them, so the configured filter is always applied in userspace as well */
+static bool
+match_filter(struct ct_flow *flow)
 {
-	struct nl_msg *req = NULL;
-	struct nl_cb *cb = NULL;
-	struct nlattr *tuple, *ip, *proto;
-	struct nfgenmsg hdr = {
-		.nfgen_family = AF_UNSPEC,
-		.version = NFNETLINK_V0,
-		.res_id = 0, //htons(res_id),
-	};
+	if (opt.filter.family && flow->family != opt.filter.family)
+		return false;
 
-	int err, ret;
+	if (opt.filter.proto && flow->orig.proto != opt.filter.proto)
+		return false;
 
-	errno = ENOMEM;
+	if ((flow->mark & opt.filter.mark_mask) != opt.filter.mark)
+		return false;
 
-	req = nlmsg_alloc_simple(
-		(NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_GET_CTRZERO,
-		NLM_F_REQUEST | NLM_F_DUMP);
+	if (opt.filter.zone >= 0 && flow->zone != opt.filter.zone)
+		return false;
 
-	if (!req)
-		goto err;
+	return true;
+}
 
-	if (nlmsg_append(req, &hdr, sizeof(hdr), NLMSG_ALIGNTO) < 0)
-		goto err;
+static void
+account_flow(struct ct_flow *flow, bool allow_insert, bool update_mac)
+{
+	struct record r = { .family = flow->family };
+	struct protocol *pr;
+	int err;
 
-	cb = nl_cb_alloc(NL_CB_DEFAULT);
-	if (!cb)
-		goto err;
+	if (!match_filter(flow))
+		return;
+
+	/* local -> remote */
+	if (!match_subnet(r.family, &flow->orig.saddr) &&
+	    match_subnet(r.family, &flow->orig.daddr)) {
+		r.proto = flow->orig.proto;
+		r.dst_port = flow->orig.dst_port;
+		r.in_pkts = flow->reply_ctr.pkts;
+		r.in_bytes = flow->reply_ctr.bytes;
+		r.out_pkts = flow->orig_ctr.pkts;
+		r.out_bytes = flow->orig_ctr.bytes;
+		r.src_addr.in6 = flow->orig.saddr;
+	}
 
-	tuple = nla_nest_start(req, CTA_TUPLE_ORIG);
-	if (!tuple)
-		goto err;
+	/* remote -> local */
+	else if (!match_subnet(r.family, &flow->reply.saddr) &&
+	         match_subnet(r.family, &flow->reply.daddr)) {
+		r.proto = flow->reply.proto;
+		r.dst_port = flow->reply.src_port;
+		r.in_pkts = flow->orig_ctr.pkts;
+		r.in_bytes = flow->orig_ctr.bytes;
+		r.out_pkts = flow->reply_ctr.pkts;
+		r.out_bytes = flow->reply_ctr.bytes;
+		r.src_addr.in6 = flow->reply.saddr;
+	}
 
-	ip = nla_nest_start(req, CTA_TUPLE_IP);
-	if (!ip)
-		goto err;
+	/* local -> local or remote -> remote */
+	else {
+		return;
+	}
 
-	//addr = nfnl_ct_get_src(ct, repl);
-	//if (addr)
-	//	NLA_PUT_ADDR(req,
-	//		     family == AF_INET ? CTA_IP_V4_SRC : CTA_IP_V6_SRC,
-	//		     addr);
-	//
-	//addr = nfnl_ct_get_dst(ct, repl);
-	//if (addr)
-	//	NLA_PUT_ADDR(req,
-	//		     family == AF_INET ? CTA_IP_V4_DST : CTA_IP_V6_DST,
-	//		     addr);
-
-	nla_nest_end(req, ip);
-
-	proto = nla_nest_start(req, CTA_TUPLE_PROTO);
-	if (!proto)
-		goto err;
+	pr = lookup_protocol(r.proto, be16toh(r.dst_port));
 
-	//if (nfnl_ct_test_proto(ct))
-	//	NLA_PUT_U8(req, CTA_PROTO_NUM, nfnl_ct_get_proto(ct));
-	//
-	//if (nfnl_ct_test_src_port(ct, repl))
-	//	NLA_PUT_U16(req, CTA_PROTO_SRC_PORT,
-	//		htons(nfnl_ct_get_src_port(ct, repl)));
-	//
-	//if (nfnl_ct_test_dst_port(ct, repl))
-	//	NLA_PUT_U16(req, CTA_PROTO_DST_PORT,
-	//		htons(nfnl_ct_get_dst_port(ct, repl)));
-	//
-	//if (nfnl_ct_test_icmp_id(ct, repl))
-	//	NLA_PUT_U16(req, CTA_PROTO_ICMP_ID,
-	//		htons(nfnl_ct_get_icmp_id(ct, repl)));
-	//
-	//if (nfnl_ct_test_icmp_type(ct, repl))
-	//	NLA_PUT_U8(req, CTA_PROTO_ICMP_TYPE,
-	//		    nfnl_ct_get_icmp_type(ct, repl));
-	//
-	//if (nfnl_ct_test_icmp_code(ct, repl))
-	//	NLA_PUT_U8(req, CTA_PROTO_ICMP_CODE,
-	//		    nfnl_ct_get_icmp_code(ct, repl));
-
-	nla_nest_end(req, proto);
-
-	nla_nest_end(req, tuple);
-
-	nl_cb_set(cb, NL_CB_VALID, NL_CB_CUSTOM, handle_dump, &allow_insert);
-	nl_cb_set(cb, NL_CB_FINISH, NL_CB_CUSTOM, handle_finish, &err);
-	nl_cb_set(cb, NL_CB_ACK, NL_CB_CUSTOM, handle_ack, &err);
-	nl_cb_set(cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, handle_seq, NULL);
-	nl_cb_err(cb, NL_CB_CUSTOM, handle_error, &err);
-
-	if (nl_send_auto_complete(nl, req) < 0)
-		goto err;
+	if (pr) {
+		r.dst_port = htobe16(pr->key_port);
+	}
+	else {
+		r.proto = 0;
+		r.dst_port = 0;
+	}
 
-	for (err = 1; err > 0; ) {
-		ret = nl_recvmsgs(nl, cb);
+	r.zone = htobe16(flow->zone);
 
-		if (ret < 0) {
-			fprintf(stderr, "Netlink receive failure: %s\n", nl_geterror(ret));
-			err = (-ret == NLE_NOMEM) ? -ENOBUFS : -EIO;
-			break;
-		}
+	if (opt.mark_mask)
+		r.mark = htobe16((flow->mark & opt.mark_mask) >> opt.mark_shift);
+
+	r.count = htobe64(allow_insert);
+
+	if (update_mac)
+		update_macaddr(r.family, &r.src_addr.in6);
+
+	err = lookup_macaddr(r.family, &r.src_addr.in6, &r.src_mac.ea);
+
+	if (update_mac && err == -ENOENT) {
+		database_insert_delayed(&r);
+		return;
 	}
 
-	errno = -err;
+	if (err == 0)
+		collapse_addr(&r);
 
-err:
-	if (cb)
-		nl_cb_put(cb);
+	agg_add(&r);
+}
+
+static void
+parse_event(void *reply, int len, bool allow_insert, bool update_mac)
+{
+	struct nlmsghdr *hdr;
+	struct ct_flow flow;
 
-	if (req)
-		nlmsg_free(req);
+	for (hdr = reply; nlmsg_ok(hdr, len); hdr = nlmsg_next(hdr, &len))
+		if (decode_event(hdr, &flow))
+			account_flow(&flow, allow_insert, update_mac);
+}
 
-	return -errno;
+static int
+read_meminfo(uint32_t *mem)
+{
+#ifdef SO_MEMINFO
+	socklen_t len = SK_MEMINFO_VARS * sizeof(*mem);
+
+	if (getsockopt(ufd.fd, SOL_SOCKET, SO_MEMINFO, mem, &len))
+		return -errno;
+
+	if (len <= SK_MEMINFO_DROPS * sizeof(*mem))
+		return -EOPNOTSUPP;
+
+	return 0;
+#else
+	return -EOPNOTSUPP;
+#endif
+}
+
+static bool
+check_rmem_max(int bufsize);
+
+static void
+handle_dump(struct uloop_fd *fd, unsigned int ev);
+
+static struct dump_slice *
+slice_init(uint8_t family);
+
+/* worker threads must not run the signal handlers, which save and modify
+ * the database owned by the main thread */
+static int
+start_thread(pthread_t *thread, void *(*fn)(void *), void *arg)
+{
+	sigset_t all, old;
+	int err;
+
+	sigfillset(&all);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+
+	err = pthread_create(thread, NULL, fn, arg);
+
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	return err;
+}
+
+static int
+set_buffer_size(int size)
+{
+	static bool rmem_warned = false;
+
+	/* try to bypass net.core.rmem_max if we're privileged enough, only
+	 * warn about the sysctl limit once as autoscaling retries often */
+	if (setsockopt(ufd.fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size))) {
+		if (!rmem_warned)
+			rmem_warned = check_rmem_max(size);
+
+		if (setsockopt(ufd.fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)))
+			return -errno;
+	}
+
+	buf_size = size;
+	nfnl_stats.bufsize = size;
+
+	return 0;
+}
+
+static void
+scale_buffer(int size)
+{
+	int old_size = buf_size;
+
+	if (size > buf_max)
+		size = buf_max;
+
+	if (size < buf_min)
+		size = buf_min;
+
+	if (size == buf_size || set_buffer_size(size))
+		return;
+
+	if (size > old_size)
+		nfnl_stats.grows++;
+	else
+		nfnl_stats.shrinks++;
+}
+
+static void
+handle_scale(struct uloop_timeout *tm)
+{
+	uloop_timeout_set(tm, NFNL_SCALE_INTERVAL);
+
+	/* the kernel accounts twice the requested size, so this checks
+	 * whether the peak usage stayed below a quarter of the buffer */
+	if (buf_peak < buf_size / 2)
+		buf_idle++;
+	else
+		buf_idle = 0;
+
+	buf_peak = 0;
+
+	if (buf_idle >= NFNL_SCALE_IDLE) {
+		buf_idle = 0;
+		scale_buffer(buf_size / 2);
+	}
+}
+
+static void
+budget_start(struct budget *b)
+{
+	b->msgs = 0;
+	b->deadline = opt.budget.usecs ? now_us() + opt.budget.usecs : 0;
+}
+
+/* account processed messages and check whether the configured per
+ * iteration budget is used up, in which case the caller should yield
+ * to uloop and resume on the next (level triggered) wakeup */
+static bool
+budget_exhausted(struct budget *b, uint32_t msgs)
+{
+	b->msgs += msgs;
+
+	if ((opt.budget.msgs && b->msgs >= opt.budget.msgs) ||
+	    (b->deadline && now_us() >= b->deadline)) {
+		nfnl_stats.yields++;
+		return true;
+	}
+
+	return false;
+}
+
+static void
+handle_resync(struct uloop_timeout *tm)
+{
+	int err;
+
+	nfnl_stats.resyncs++;
+
+	err = nfnetlink_dump(false, NULL);
+
+	if (err)
+		fprintf(stderr, "Unable to resync conntrack counters: %s\n",
+		        strerror(-err));
+
+	resync_time = now_ms();
+}
+
+/* The kernel reports an overflow of the event socket receive buffer with
+ * ENOBUFS. Since ctnetlink events carry no sequence numbers, the amount
+ * of lost events is estimated from the socket drop counter. Counters of
+ * flows which are still alive are recovered by an immediate zeroing dump,
+ * byte counts of lost destroy events are gone for good. */
+static void
+handle_overflow(void)
+{
+	uint32_t mem[SK_MEMINFO_VARS];
+
+	nfnl_stats.overflows++;
+
+	if (!read_meminfo(mem)) {
+		nfnl_stats.lost += (uint32_t)(mem[SK_MEMINFO_DROPS] - sock_drops);
+		sock_drops = mem[SK_MEMINFO_DROPS];
+	}
+
+	if (buf_max)
+		scale_buffer(buf_size * 2);
+
+	/* don't spin when the buffer overflowed during the last resync */
+	if (!resync_tm.pending)
+		uloop_timeout_set(&resync_tm,
+			(now_ms() - resync_time < NFNL_RESYNC_DELAY) ? NFNL_RESYNC_DELAY : 0);
+}
+
+static void
+check_backlog(void)
+{
+	uint32_t mem[SK_MEMINFO_VARS];
+
+	/* grow the receive buffer if it is filled by more than a half */
+	if (buf_max && !read_meminfo(mem)) {
+		if (mem[SK_MEMINFO_RMEM_ALLOC] > buf_peak)
+			buf_peak = mem[SK_MEMINFO_RMEM_ALLOC];
+
+		if (mem[SK_MEMINFO_RMEM_ALLOC] > mem[SK_MEMINFO_RCVBUF] / 2)
+			scale_buffer(buf_size * 2);
+	}
+}
+
+static void
+update_batch_stats(uint32_t total)
+{
+	uint32_t max = __atomic_load_n(&nfnl_stats.batch_max, __ATOMIC_RELAXED);
+
+	stats_add(wakeups, 1);
+	stats_add(messages, total);
+	__atomic_store_n(&nfnl_stats.batch_last, total, __ATOMIC_RELAXED);
+
+	while (total > max &&
+	       !__atomic_compare_exchange_n(&nfnl_stats.batch_max, &max, total,
+	                                    false, __ATOMIC_RELAXED,
+	                                    __ATOMIC_RELAXED))
+		;
+}
+
+static void
+handle_event(struct uloop_fd *fd, unsigned int ev)
+{
+	struct nlmsghdr *hdr;
+	struct budget b;
+	uint32_t total = 0;
+	bool is_new;
+	int i, n;
+
+	budget_start(&b);
+	check_backlog();
+	database_archive(gdbh);
+
+	while (true) {
+		n = recvmmsg(fd->fd, rx_msgs, NFNL_BATCH_SIZE, MSG_DONTWAIT, NULL);
+
+		if (n < 0 && errno == ENOBUFS) {
+			handle_overflow();
+			continue;
+		}
+
+		if (n <= 0)
+			break;
+
+		for (i = 0; i < n; i++) {
+			/* event did not fit into the receive buffer, skip it */
+			if (rx_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				stats_add(truncated, 1);
+				continue;
+			}
+
+			hdr = (struct nlmsghdr *)rx_bufs[i];
+			is_new = (NFNL_MSG_TYPE(hdr->nlmsg_type) == IPCTNL_MSG_CT_NEW);
+			parse_event(hdr, rx_msgs[i].msg_len, is_new, is_new);
+		}
+
+		total += n;
+
+		if (n < NFNL_BATCH_SIZE || budget_exhausted(&b, n))
+			break;
+	}
+
+	agg_flush();
+	update_batch_stats(total);
+}
+
+static void
+ring_publish(struct ct_ring *r, int fd, uint32_t head)
+{
+	__atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+	eventfd_write(fd, 1);
+}
+
+static uint32_t
+ring_push(struct ct_ring *r, int fd, struct nlmsghdr *hdr, int len,
+          uint32_t head, bool is_dump)
+{
+	struct ct_event *ev;
+	bool is_new;
+
+	for (; nlmsg_ok(hdr, len); hdr = nlmsg_next(hdr, &len)) {
+		/* ring is full, wait for the main loop to catch up and leave
+		 * pending events in the socket buffer meanwhile */
+		while (head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) >= NFNL_RING_SIZE) {
+			ring_publish(r, fd, head);
+			stats_add(ring_stalls, 1);
+			usleep(1000);
+		}
+
+		ev = &r->events[head % NFNL_RING_SIZE];
+
+		if (!decode_event(hdr, &ev->flow))
+			continue;
+
+		if (is_dump) {
+			ev->allow_insert = dump.allow_insert;
+			ev->update_mac = true;
+		}
+		else {
+			is_new = (NFNL_MSG_TYPE(hdr->nlmsg_type) == IPCTNL_MSG_CT_NEW);
+			ev->allow_insert = is_new;
+			ev->update_mac = is_new;
+		}
+
+		head++;
+	}
+
+	return head;
+}
+
+/* account queued events, returns false if the budget got exhausted
+ * before the ring was drained */
+static bool
+ring_drain(struct ct_ring *r, int fd, struct budget *b)
+{
+	uint32_t head, tail;
+	struct ct_event *e;
+	bool drained = true;
+
+	head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+	tail = r->tail;
+
+	while (tail != head) {
+		e = &r->events[tail++ % NFNL_RING_SIZE];
+		account_flow(&e->flow, e->allow_insert, e->update_mac);
+
+		/* release consumed slots early to unblock a stalled producer */
+		if (!(tail % NFNL_BATCH_SIZE)) {
+			__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+
+			/* rearm the eventfd to resume after yielding */
+			if (tail != head && b && budget_exhausted(b, NFNL_BATCH_SIZE)) {
+				eventfd_write(fd, 1);
+				drained = false;
+				break;
+			}
+		}
+	}
+
+	__atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+	agg_flush();
+
+	return drained;
+}
+
+static void *
+ingest_main(void *arg)
+{
+	struct pollfd pfd = { .fd = ufd.fd, .events = POLLIN };
+	uint32_t head, total;
+	int i, n;
+
+	while (true) {
+		if (poll(&pfd, 1, -1) < 0)
+			continue;
+
+		head = ring->head;
+		total = 0;
+
+		while (true) {
+			n = recvmmsg(ufd.fd, rx_msgs, NFNL_BATCH_SIZE, MSG_DONTWAIT, NULL);
+
+			/* let the main loop deal with the overflow */
+			if (n < 0 && errno == ENOBUFS) {
+				__atomic_add_fetch(&ring->overflows, 1, __ATOMIC_RELEASE);
+				eventfd_write(ring_fd.fd, 1);
+				continue;
+			}
+
+			if (n <= 0)
+				break;
+
+			for (i = 0; i < n; i++) {
+				if (rx_msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+					stats_add(truncated, 1);
+					continue;
+				}
+
+				head = ring_push(ring, ring_fd.fd,
+				                 (struct nlmsghdr *)rx_bufs[i],
+				                 rx_msgs[i].msg_len, head, false);
+			}
+
+			ring_publish(ring, ring_fd.fd, head);
+			total += n;
+
+			if (n < NFNL_BATCH_SIZE)
+				break;
+		}
+
+		update_batch_stats(total);
+	}
+
+	return NULL;
+}
+
+static void
+handle_ring(struct uloop_fd *fd, unsigned int ev)
+{
+	uint32_t overflows;
+	struct budget b;
+	eventfd_t val;
+
+	budget_start(&b);
+	eventfd_read(fd->fd, &val);
+
+	overflows = __atomic_load_n(&ring->overflows, __ATOMIC_ACQUIRE);
+
+	while (ring_overflows != overflows) {
+		ring_overflows++;
+		handle_overflow();
+	}
+
+	check_backlog();
+	database_archive(gdbh);
+
+	ring_drain(ring, fd->fd, &b);
+}
+
+static int
+start_ingest_thread(void)
+{
+	ring = calloc(1, sizeof(*ring));
+
+	if (!ring)
+		return -ENOMEM;
+
+	ring_fd.cb = handle_ring;
+	ring_fd.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (ring_fd.fd < 0)
+		return -errno;
+
+	if (uloop_fd_add(&ring_fd, ULOOP_READ))
+		return -errno;
+
+	errno = start_thread(&ingest_thread, ingest_main, NULL);
+
+	return -errno;
+}
+
+static bool
+check_rmem_max(int bufsize)
+{
+	char buf[16];
+	int max = 0;
+	FILE *f;
+
+	f = fopen("/proc/sys/net/core/rmem_max", "r");
+
+	if (f) {
+		if (fgets(buf, sizeof(buf), f))
+			max = atoi(buf);
+
+		fclose(f);
+	}
+
+	if (bufsize <= max)
+		return false;
+
+	fprintf(stderr,
+	        "The netlink receive buffer size of %d bytes will be capped to %d bytes\n"
+	        "by the kernel. The net.core.rmem_max sysctl limit needs to be raised to\n"
+	        "at least %d in order to sucessfully set the desired receive buffer size!\n",
+	        bufsize, max, bufsize);
+
+	return true;
+}
+
+
+static void
+init_rx_batch(void)
+{
+	int i;
+
+	for (i = 0; i < NFNL_BATCH_SIZE; i++) {
+		rx_iovs[i].iov_base = rx_bufs[i];
+		rx_iovs[i].iov_len = NFNL_BUFFER_SIZE;
+
+		rx_msgs[i].msg_hdr.msg_iov = &rx_iovs[i];
+		rx_msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+}
+
+
+int
+nfnetlink_connect(int bufsize, int bufmax)
+{
+	uint32_t mem[SK_MEMINFO_VARS];
+	int err;
+
+	init_rx_batch();
+	neigh_set_notify(handle_neigh_notify);
+
+	nl = nl_socket_alloc();
+
+	if (!nl)
+		return -ENOMEM;
+
+	if (nl_connect(nl, NETLINK_NETFILTER))
+		return -errno;
+
+	if (nl_socket_add_memberships(nl, NFNLGRP_CONNTRACK_NEW,
+	                                  NFNLGRP_CONNTRACK_DESTROY, 0))
+		return -errno;
+
+	ufd.cb = handle_event;
+	ufd.fd = nl_socket_get_fd(nl);
+
+	/* with a maximum size given, start with the minimum buffer size and
+	 * scale it according to the observed backlog */
+	if (bufmax > bufsize) {
+		buf_min = bufsize;
+		buf_max = bufmax;
+
+		scale_tm.cb = handle_scale;
+		uloop_timeout_set(&scale_tm, NFNL_SCALE_INTERVAL);
+	}
+
+	if (set_buffer_size(bufsize))
+		return -errno;
+
+	resync_tm.cb = handle_resync;
+
+	if (!read_meminfo(mem))
+		sock_drops = mem[SK_MEMINFO_DROPS];
+
+	err = filter_attach(ufd.fd);
+
+	if (err)
+		fprintf(stderr, "Unable to attach conntrack event filter, "
+		        "receiving all events: %s\n", strerror(-err));
+
+	/* dumps use a separate socket to not interfere with event reception */
+	dump_nl = nl_socket_alloc();
+
+	if (!dump_nl)
+		return -ENOMEM;
+
+	if (nl_connect(dump_nl, NETLINK_NETFILTER))
+		return -errno;
+
+	dump_fd.cb = handle_dump;
+	dump_fd.fd = nl_socket_get_fd(dump_nl);
+
+	if (opt.parallel_dump) {
+		slices[0] = slice_init(AF_INET);
+		slices[1] = slice_init(AF_INET6);
+
+		if (!slices[0] || !slices[1])
+			return -ENOMEM;
+
+		n_slices = 2;
+	}
+
+	if (opt.ingest_thread)
+		return start_ingest_thread();
+
+	if (uloop_fd_add(&ufd, ULOOP_READ))
+		return -errno;
+
+	return 0;
+}
+
+/* dump filter attributes, missing from uapi headers before Linux 5.8 */
+#ifndef CTA_FILTER_MAX
+#define CTA_FILTER 25
+#define CTA_FILTER_ORIG_FLAGS 1
+#define CTA_FILTER_REPLY_FLAGS 2
+#endif
+
+/* kernel internal flag values for CTA_FILTER_ORIG_FLAGS */
+#ifndef CTA_FILTER_F_CTA_PROTO_NUM
+#define CTA_FILTER_F_CTA_PROTO_NUM (1 << 3)
+#endif
+
+static struct nl_msg *
+dump_request(uint8_t family, bool filter)
+{
+	struct nlattr *tuple, *proto, *flags;
+	struct nl_msg *req;
+	struct nfgenmsg hdr = {
+		.nfgen_family = family,
+		.version = NFNETLINK_V0,
+	};
+
+	req = nlmsg_alloc_simple(
+		(NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_GET_CTRZERO,
+		NLM_F_REQUEST | NLM_F_DUMP);
+
+	if (!req)
+		return NULL;
+
+	if (nlmsg_append(req, &hdr, sizeof(hdr), NLMSG_ALIGNTO) < 0)
+		goto err;
+
+	if (!filter)
+		return req;
+
+	if (opt.filter.mark_mask) {
+		if (nla_put_u32(req, CTA_MARK, htobe32(opt.filter.mark)) ||
+		    nla_put_u32(req, CTA_MARK_MASK, htobe32(opt.filter.mark_mask)))
+			goto err;
+	}
+
+	/* the kernel only parses CTA_ZONE along with a CTA_FILTER nest and
+	 * treats zone 0 as unset, match_filter() takes care of that case */
+	if (opt.filter.zone >= 0) {
+		if (nla_put_u16(req, CTA_ZONE, htobe16(opt.filter.zone)))
+			goto err;
+	}
+
+	if (opt.filter.proto || opt.filter.zone >= 0) {
+		flags = nla_nest_start(req, CTA_FILTER);
+		if (!flags)
+			goto err;
+
+		if (nla_put_u32(req, CTA_FILTER_ORIG_FLAGS,
+		                opt.filter.proto ? CTA_FILTER_F_CTA_PROTO_NUM : 0))
+			goto err;
+
+		nla_nest_end(req, flags);
+	}
+
+	if (opt.filter.proto) {
+		tuple = nla_nest_start(req, CTA_TUPLE_ORIG);
+		if (!tuple)
+			goto err;
+
+		proto = nla_nest_start(req, CTA_TUPLE_PROTO);
+		if (!proto)
+			goto err;
+
+		if (nla_put_u8(req, CTA_PROTO_NUM, opt.filter.proto))
+			goto err;
+
+		nla_nest_end(req, proto);
+		nla_nest_end(req, tuple);
+	}
+
+	return req;
+
+err:
+	nlmsg_free(req);
+	return NULL;
+}
+
+static void
+dump_finish(int err);
+
+static void *
+slice_main(void *arg)
+{
+	struct dump_slice *sl = arg;
+	struct nlmsghdr *hdr;
+	struct nlmsgerr *e;
+	uint32_t head = sl->ring->head;
+	int len, fd = nl_socket_get_fd(sl->sock);
+	bool done = false;
+
+	while (!done) {
+		len = recv(fd, sl->buf, sizeof(sl->buf), 0);
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			sl->err = -errno;
+			break;
+		}
+
+		for (hdr = (struct nlmsghdr *)sl->buf;
+		     nlmsg_ok(hdr, len);
+		     hdr = nlmsg_next(hdr, &len)) {
+			if (hdr->nlmsg_seq != sl->seq)
+				continue;
+
+			if (hdr->nlmsg_type == NLMSG_DONE) {
+				done = true;
+				break;
+			}
+
+			if (hdr->nlmsg_type == NLMSG_ERROR) {
+				e = nlmsg_data(hdr);
+				sl->err = e->error;
+				done = true;
+				break;
+			}
+
+			head = ring_push(sl->ring, sl->fd.fd, hdr, hdr->nlmsg_len,
+			                 head, true);
+		}
+
+		ring_publish(sl->ring, sl->fd.fd, head);
+	}
+
+	/* the release store orders the error code before the flag */
+	__atomic_store_n(&sl->done, true, __ATOMIC_RELEASE);
+	ring_publish(sl->ring, sl->fd.fd, head);
+
+	return NULL;
+}
+
+static void
+slice_receive(struct dump_slice *sl, struct budget *b)
+{
+	eventfd_t val;
+	bool done;
+
+	if (!sl->active)
+		return;
+
+	eventfd_read(sl->fd.fd, &val);
+
+	/* load the flag before draining, so that no event published by the
+	 * worker before finishing is missed */
+	done = __atomic_load_n(&sl->done, __ATOMIC_ACQUIRE);
+
+	if (!ring_drain(sl->ring, sl->fd.fd, b) || !done)
+		return;
+
+	pthread_join(sl->thread, NULL);
+	uloop_fd_delete(&sl->fd);
+	sl->active = false;
+
+	if (sl->err && !dump.slice_err)
+		dump.slice_err = sl->err;
+
+	if (--dump.slices == 0)
+		dump_finish(dump.slice_err);
+}
+
+static void
+handle_slice(struct uloop_fd *fd, unsigned int ev)
+{
+	struct dump_slice *sl = container_of(fd, struct dump_slice, fd);
+	struct budget b;
+
+	budget_start(&b);
+	slice_receive(sl, &b);
+}
+
+static int
+slice_start(struct dump_slice *sl)
+{
+	struct nl_msg *req;
+	int err;
+
+	req = dump_request(sl->family, filter_supported);
+
+	if (!req)
+		return -ENOMEM;
+
+	err = nl_send_auto_complete(sl->sock, req);
+	sl->seq = nlmsg_hdr(req)->nlmsg_seq;
+
+	nlmsg_free(req);
+
+	if (err < 0)
+		return (-err == NLE_NOMEM) ? -ENOBUFS : -EIO;
+
+	sl->done = false;
+	sl->err = 0;
+
+	if (uloop_fd_add(&sl->fd, ULOOP_READ))
+		return -errno;
+
+	errno = start_thread(&sl->thread, slice_main, sl);
+
+	if (errno) {
+		uloop_fd_delete(&sl->fd);
+		return -errno;
+	}
+
+	sl->active = true;
+	dump.slices++;
+
+	return 0;
+}
+
+static struct dump_slice *
+slice_init(uint8_t family)
+{
+	struct dump_slice *sl;
+
+	sl = calloc(1, sizeof(*sl));
+
+	if (!sl)
+		return NULL;
+
+	sl->family = family;
+	sl->ring = calloc(1, sizeof(*sl->ring));
+	sl->sock = nl_socket_alloc();
+	sl->fd.cb = handle_slice;
+	sl->fd.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+	if (!sl->ring || !sl->sock || sl->fd.fd < 0 ||
+	    nl_connect(sl->sock, NETLINK_NETFILTER)) {
+		if (sl->fd.fd >= 0)
+			close(sl->fd.fd);
+
+		if (sl->sock)
+			nl_socket_free(sl->sock);
+
+		free(sl->ring);
+		free(sl);
+
+		return NULL;
+	}
+
+	return sl;
+}
+
+static int
+dump_start(void)
+{
+	struct nl_msg *req;
+	int i, err = 0;
+
+	/* dump each address family concurrently on its own worker thread */
+	if (n_slices && !opt.filter.family) {
+		dump.slice_err = 0;
+
+		for (i = 0; i < n_slices; i++) {
+			err = slice_start(slices[i]);
+
+			if (err) {
+				/* let already running slices complete */
+				dump.slice_err = err;
+				break;
+			}
+		}
+
+		if (dump.slices == 0)
+			return err;
+
+		dump.running = true;
+
+		return 0;
+	}
+
+	req = dump_request(opt.filter.family, filter_supported);
+
+	if (!req)
+		return -ENOMEM;
+
+	err = nl_send_auto_complete(dump_nl, req);
+	dump.seq = nlmsg_hdr(req)->nlmsg_seq;
+
+	nlmsg_free(req);
+
+	if (err < 0)
+		return (-err == NLE_NOMEM) ? -ENOBUFS : -EIO;
+
+	if (uloop_fd_add(&dump_fd, ULOOP_READ))
+		return -errno;
+
+	dump.running = true;
+
+	return 0;
+}
+
+static void
+dump_finish(int err)
+{
+	nfnetlink_dump_cb cb = dump.cb;
+
+	agg_flush();
+
+	uloop_fd_delete(&dump_fd);
+	dump.running = false;
+
+	/* kernel rejected the filter attributes, retry without them */
+	if (filter_supported && (err == -EINVAL || err == -EOPNOTSUPP)) {
+		fprintf(stderr, "Kernel does not support conntrack dump filters, "
+		                "filtering in userspace\n");
+
+		filter_supported = false;
+		err = dump_start();
+
+		if (!err)
+			return;
+	}
+
+	if (err)
+		fprintf(stderr, "Unable to dump conntrack: %s\n", strerror(-err));
+	else
+		dump_time = now_ms();
+
+	dump.err = err;
+	dump.cb = NULL;
+
+	if (cb)
+		cb(err);
+
+	/* start the dump requested while this one was running */
+	if (dump.pending && !dump.running) {
+		dump.pending = false;
+		dump.allow_insert = dump.pending_insert;
+		dump.cb = dump.pending_cb;
+
+		err = dump_start();
+
+		if (err)
+			dump_finish(err);
+	}
+}
+
+/* process dump replies until the dump completed or the budget is used up,
+ * in which case the remaining replies are picked up on the next wakeup */
+static void
+dump_receive(struct budget *b)
+{
+	struct nlmsghdr *hdr;
+	struct nlmsgerr *e;
+	uint32_t n;
+	int len;
+
+	while (dump.running) {
+		len = recv(dump_fd.fd, dump_buf, sizeof(dump_buf), MSG_DONTWAIT);
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				dump_finish(-errno);
+
+			return;
+		}
+
+		for (hdr = (struct nlmsghdr *)dump_buf, n = 0;
+		     nlmsg_ok(hdr, len);
+		     hdr = nlmsg_next(hdr, &len), n++) {
+			/* leftover of a previously aborted dump */
+			if (hdr->nlmsg_seq != dump.seq)
+				continue;
+
+			if (hdr->nlmsg_type == NLMSG_DONE) {
+				dump_finish(0);
+				return;
+			}
+
+			if (hdr->nlmsg_type == NLMSG_ERROR) {
+				e = nlmsg_data(hdr);
+				dump_finish(e->error);
+				return;
+			}
+
+			parse_event(hdr, hdr->nlmsg_len, dump.allow_insert, true);
+		}
+
+		/* a single reply carries many messages, charge all of them */
+		if (b && budget_exhausted(b, n))
+			return;
+	}
+}
+
+static void
+handle_dump(struct uloop_fd *fd, unsigned int ev)
+{
+	struct budget b;
+
+	budget_start(&b);
+	dump_receive(&b);
+	agg_flush();
+}
+
+int
+nfnetlink_dump(bool allow_insert, nfnetlink_dump_cb cb)
+{
+	/* queue the request, requests piling up meanwhile are merged */
+	if (dump.running) {
+		if (!dump.pending)
+			dump.pending_insert = false;
+
+		dump.pending = true;
+		dump.pending_insert |= allow_insert;
+
+		if (cb)
+			dump.pending_cb = cb;
+
+		return 0;
+	}
+
+	dump.allow_insert = allow_insert;
+	dump.cb = cb;
+
+	return dump_start();
+}
+
+int
+nfnetlink_dump_wait(void)
+{
+	struct pollfd pfd = { .fd = dump_fd.fd, .events = POLLIN };
+	int i;
+
+	while (dump.running) {
+		/* slices complete independently, just cycle through them */
+		if (dump.slices) {
+			for (i = 0; i < n_slices && dump.slices; i++)
+				slice_receive(slices[i], NULL);
+
+			if (dump.slices)
+				usleep(1000);
+
+			continue;
+		}
+
+		if (poll(&pfd, 1, -1) < 0 && errno != EINTR)
+			return -errno;
+
+		dump_receive(NULL);
+	}
+
+	return dump.err;
+}
+
+/* recompile the event filter after the local subnets changed, attaching
+ * a new program atomically replaces the previous one */
+int
+nfnetlink_update_filter(void)
+{
+	int err;
+
+	if (!ufd.fd)
+		return 0;
+
+	err = filter_attach(ufd.fd);
+
+	if (err)
+		fprintf(stderr, "Unable to update conntrack event filter, "
+		        "receiving all events: %s\n", strerror(-err));
+
+	return err;
+}
+
+/* In event driven mode the counters of live flows are only fetched when
+ * they're actually needed, at most once per refresh interval. Unless told
+ * to wait, the refresh completes in the background if a budget is set. */
+int
+nfnetlink_refresh(bool wait)
+{
+	int err;
+
+	if (!opt.reconcile_interval)
+		return 0;
+
+	if (dump_time && now_ms() - dump_time < opt.refresh_interval * 1000)
+		return 0;
+
+	err = nfnetlink_dump(false, NULL);
+
+	if (err)
+		return err;
+
+	if (wait || !(opt.budget.msgs || opt.budget.usecs))
+		return nfnetlink_dump_wait();
+
+	return 0;
 }
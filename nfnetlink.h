@@ -20,11 +20,37 @@
 #define __NFNETLINK_H__
 
 #include <stdbool.h>
+#include <stdint.h>
 
 #include "database.h"
 
-
-int nfnetlink_connect(int bufsize);
-int nfnetlink_dump(bool allow_insert);
+struct nfnetlink_stats {
+	uint64_t wakeups;
+	uint64_t messages;
+	uint64_t truncated;
+	uint64_t overflows;
+	uint64_t lost;
+	uint64_t resyncs;
+	uint64_t grows;
+	uint64_t shrinks;
+	uint64_t ring_stalls;
+	uint64_t yields;
+	uint64_t agg_in;
+	uint64_t agg_out;
+	uint64_t insert_overflows;
+	uint32_t bufsize;
+	uint32_t batch_last;
+	uint32_t batch_max;
+};
+
+extern struct nfnetlink_stats nfnl_stats;
+
+typedef void (*nfnetlink_dump_cb)(int err);
+
+int nfnetlink_connect(int bufsize, int bufmax);
+int nfnetlink_dump(bool allow_insert, nfnetlink_dump_cb cb);
+int nfnetlink_dump_wait(void);
+int nfnetlink_refresh(bool wait);
+int nfnetlink_update_filter(void);
 
 #endif /* __NFNETLINK_H__ */
@@ -77,6 +77,15 @@ struct options opt = {
 
 	.db = {
 		.directory = "/usr/share/nlbwmon/db"
+	},
+
+	.filter = {
+		.zone = -1
+	},
+
+	.neigh = {
+		.limit = 8192,
+		.timeout = 86400
 	}
 };
 
@@ -85,6 +94,12 @@ static void save_persistent(uint32_t timestamp)
 {
 	int err;
 
+	err = nfnetlink_refresh(true);
+
+	if (err)
+		fprintf(stderr, "Unable to refresh conntrack counters: %s\n",
+		        strerror(-err));
+
 	err = database_save(gdbh, opt.db.directory, timestamp, opt.db.compress);
 
 	if (err == -EEXIST) {
@@ -106,7 +121,15 @@ static void save_persistent(uint32_t timestamp)
 	}
 }
 
+static volatile sig_atomic_t shutdown_signal;
+
 static void handle_shutdown(int sig)
+{
+	shutdown_signal = sig;
+	uloop_end();
+}
+
+static void shutdown_save(int sig)
 {
 	char path[256];
 	uint32_t timestamp = interval_timestamp(&opt.archive_interval, 0);
@@ -120,9 +143,6 @@ static void handle_shutdown(int sig)
 	else {
 		database_save(gdbh, opt.tempdir, 0, false);
 	}
-
-	uloop_done();
-	exit(0);
 }
 
 static void
@@ -134,12 +154,26 @@ handle_commit(struct uloop_timer_type *tm)
 	save_persistent(timestamp);
 }
 
+static time_t
+refresh_period(void)
+{
+	return opt.reconcile_interval ? opt.reconcile_interval
+	                              : opt.refresh_interval;
+}
+
+static void
+handle_refresh_done(int err)
+{
+	if (!err)
+		database_save(gdbh, opt.tempdir, 0, false);
+}
+
 static void
 handle_refresh(struct uloop_timer_type *tm)
 {
 	int err;
 
-	uloop_timer_reset(tm, opt.refresh_interval * 1000);
+	uloop_timer_reset(tm, refresh_period() * 1000);
 
 	err = database_archive(gdbh);
 
@@ -154,15 +188,50 @@ handle_refresh(struct uloop_timer_type *tm)
 		return;
 	}
 
-	err = nfnetlink_dump(false);
+	/* the database is saved once the dump completed */
+	err = nfnetlink_dump(false, handle_refresh_done);
 
 	if (err) {
 		fprintf(stderr, "Unable to dump conntrack: %s\n",
 		        strerror(-err));
 		return;
 	}
+}
+
+static void
+handle_addr_change(void)
+{
+	int err = update_subnets();
+
+	/* filter failures are logged by nfnetlink */
+	if (err > 0)
+		nfnetlink_update_filter();
+	else if (err < 0)
+		fprintf(stderr, "Unable to update local subnets: %s\n",
+		        strerror(-err));
+}
 
-	database_save(gdbh, opt.tempdir, 0, false);
+static int
+parse_budget(const char *val)
+{
+	unsigned long n;
+	char *e;
+
+	n = strtoul(val, &e, 10);
+
+	if (e == val || n == 0 || n > 0xffffffff)
+		return -EINVAL;
+
+	if (!*e)
+		opt.budget.msgs = n;
+	else if (!strcmp(e, "us"))
+		opt.budget.usecs = n;
+	else if (!strcmp(e, "ms") && n <= 0xffffffff / 1000)
+		opt.budget.usecs = n * 1000;
+	else
+		return -EINVAL;
+
+	return 0;
 }
 
 static int
@@ -211,14 +280,32 @@ static int
 server_main(int argc, char **argv)
 {
 	struct sigaction sa = { .sa_handler = handle_shutdown };
+	struct protoent *pe;
 	uint32_t timestamp;
+	unsigned long n;
 	int optchr, err;
-	char *e;
+	char *e, *p;
 
-	while ((optchr = getopt(argc, argv, "b:i:r:s:o:p:G:I:L:PZ")) > -1) {
+	while ((optchr = getopt(argc, argv, "a:b:e:f:i:jl:m:r:s:o:p:t:z:C:G:I:L:M:N:PTZ")) > -1) {
 		switch (optchr) {
+		case 'a':
+			err = add_subnet_interface(optarg);
+			if (err) {
+				fprintf(stderr, "Invalid interface '%s': %s\n",
+				        optarg, strerror(-err));
+				return 1;
+			}
+			break;
+
 		case 'b':
 			opt.netlink_buffer_size = (int)strtol(optarg, &e, 0);
+			if (e != optarg && *e == ',') {
+				p = e + 1;
+				opt.netlink_buffer_max = (int)strtol(p, &e, 0);
+				if (e == p || opt.netlink_buffer_max < opt.netlink_buffer_size ||
+				    opt.netlink_buffer_max > 0x40000000)
+					e = optarg;
+			}
 			if (e == optarg || *e || opt.netlink_buffer_size < 32768) {
 				fprintf(stderr, "Invalid netlink buffer size '%s'\n",
 				        optarg);
@@ -226,6 +313,79 @@ server_main(int argc, char **argv)
 			}
 			break;
 
+		case 'e':
+			err = parse_timearg(optarg, &opt.reconcile_interval);
+			if (err) {
+				fprintf(stderr, "Invalid reconcile interval '%s': %s\n",
+				        optarg, strerror(-err));
+				return 1;
+			}
+			break;
+
+		case 'f':
+			if (!strcmp(optarg, "4") || !strcmp(optarg, "ipv4")) {
+				opt.filter.family = AF_INET;
+			}
+			else if (!strcmp(optarg, "6") || !strcmp(optarg, "ipv6")) {
+				opt.filter.family = AF_INET6;
+			}
+			else {
+				fprintf(stderr, "Invalid address family '%s'\n", optarg);
+				return 1;
+			}
+			break;
+
+		case 'j':
+			opt.parallel_dump = true;
+			break;
+
+		case 'l':
+			n = strtoul(optarg, &e, 10);
+			if (e == optarg || *e) {
+				pe = getprotobyname(optarg);
+				n = pe ? pe->p_proto : 0;
+			}
+			if (n == 0 || n > 255) {
+				fprintf(stderr, "Invalid protocol '%s'\n", optarg);
+				return 1;
+			}
+			opt.filter.proto = n;
+			break;
+
+		case 'm':
+			opt.filter.mark = strtoul(optarg, &e, 0);
+			opt.filter.mark_mask = 0xffffffff;
+			if (e != optarg && *e == '/') {
+				p = e + 1;
+				opt.filter.mark_mask = strtoul(p, &e, 0);
+				if (e == p || !opt.filter.mark_mask)
+					e = optarg;
+			}
+			if (e == optarg || *e) {
+				fprintf(stderr, "Invalid mark '%s'\n", optarg);
+				return 1;
+			}
+			opt.filter.mark &= opt.filter.mark_mask;
+			break;
+
+		case 't':
+			err = parse_budget(optarg);
+			if (err) {
+				fprintf(stderr, "Invalid processing budget '%s': %s\n",
+				        optarg, strerror(-err));
+				return 1;
+			}
+			break;
+
+		case 'z':
+			n = strtoul(optarg, &e, 10);
+			if (e == optarg || *e || n > 65535) {
+				fprintf(stderr, "Invalid zone '%s'\n", optarg);
+				return 1;
+			}
+			opt.filter.zone = n;
+			break;
+
 		case 'i':
 			err = parse_timearg(optarg, &opt.commit_interval);
 			if (err) {
@@ -261,6 +421,15 @@ server_main(int argc, char **argv)
 			opt.protocol_db = optarg;
 			break;
 
+		case 'C':
+			opt.collapse.enabled = true;
+			opt.collapse.recent = strtoul(optarg, &e, 10);
+			if (e == optarg || *e || opt.collapse.recent > 255) {
+				fprintf(stderr, "Invalid recent address count '%s'\n", optarg);
+				return 1;
+			}
+			break;
+
 		case 'G':
 			opt.db.generations = strtoul(optarg, &e, 10);
 			if (e == optarg || *e != 0) {
@@ -278,10 +447,38 @@ server_main(int argc, char **argv)
 			}
 			break;
 
+		case 'M':
+			n = strtoul(optarg, &e, 0);
+			if (e == optarg || *e || n == 0 || n > 0xffffffff ||
+			    (n >> __builtin_ctzl(n)) > 0xffff) {
+				fprintf(stderr, "Invalid mark mask '%s'\n", optarg);
+				return 1;
+			}
+			opt.mark_mask = n;
+			opt.mark_shift = __builtin_ctzl(n);
+			break;
+
+		case 'N':
+			opt.neigh.limit = strtoul(optarg, &e, 10);
+			if (e != optarg && *e == ',') {
+				p = e + 1;
+				err = parse_timearg(p, &opt.neigh.timeout);
+				e = err ? optarg : p + strlen(p);
+			}
+			if (e == optarg || *e) {
+				fprintf(stderr, "Invalid neighbor cache limit '%s'\n", optarg);
+				return 1;
+			}
+			break;
+
 		case 'P':
 			opt.db.prealloc = true;
 			break;
 
+		case 'T':
+			opt.ingest_thread = true;
+			break;
+
 		case 'L':
 			opt.db.limit = strtoul(optarg, &e, 10);
 			if (e == optarg || *e != 0) {
@@ -342,7 +539,17 @@ server_main(int argc, char **argv)
 		exit(1);
 	}
 
-	err = nfnetlink_connect(opt.netlink_buffer_size);
+	neigh_set_addr_notify(handle_addr_change);
+
+	err = init_neighbors();
+
+	if (err) {
+		fprintf(stderr, "Unable to initialize neighbor cache: %s\n",
+		        strerror(-err));
+		exit(1);
+	}
+
+	err = nfnetlink_connect(opt.netlink_buffer_size, opt.netlink_buffer_max);
 
 	if (err) {
 		fprintf(stderr, "Unable to connect nfnetlink: %s\n",
@@ -367,10 +574,17 @@ server_main(int argc, char **argv)
 	uloop_timer_set(&commit_tm, opt.commit_interval * 1000);
 
 	refresh_tm.cb = handle_refresh;
-	uloop_timer_set(&refresh_tm, opt.refresh_interval * 1000);
+	uloop_timer_set(&refresh_tm, refresh_period() * 1000);
 
 	uloop_run();
 
+	/* the handler only stops the loop, the conntrack refresh and the
+	 * database save must not run from signal context */
+	if (shutdown_signal)
+		shutdown_save(shutdown_signal);
+
+	uloop_done();
+
 	return 0;
 }
 
@@ -34,9 +34,40 @@
 struct options {
 	time_t commit_interval;
 	time_t refresh_interval;
+	time_t reconcile_interval;
 	struct interval archive_interval;
 
 	int netlink_buffer_size;
+	int netlink_buffer_max;
+
+	bool ingest_thread;
+	bool parallel_dump;
+
+	uint32_t mark_mask;
+	uint8_t mark_shift;
+
+	struct {
+		uint32_t msgs;
+		uint32_t usecs;
+	} budget;
+
+	struct {
+		uint32_t limit;
+		time_t timeout;
+	} neigh;
+
+	struct {
+		bool enabled;
+		uint32_t recent;
+	} collapse;
+
+	struct {
+		uint8_t family;
+		uint8_t proto;
+		uint32_t mark;
+		uint32_t mark_mask;
+		int32_t zone;
+	} filter;
 
 	const char *protocol_db;
 	const char *tempdir;
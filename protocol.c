@@ -17,72 +17,488 @@
 */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <errno.h>
 #include <string.h>
-
-#include <libubox/utils.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "protocol.h"
-#include "nlbwmon.h"
 
+/*
+ * For constant time lookups, the protocol list is compiled into a direct
+ * index: the protocol number selects a directory indexed by the upper port
+ * byte, which yields a page indexed by the lower port byte, which finally
+ * holds the number of the matching entry, or 0 if there is none. Identical
+ * pages and directories are shared, page and directory 0 are all empty.
+ */
+typedef uint16_t pr_page_t[256];
+
+static struct protocol *pr_entries = NULL;
+static pr_page_t *pr_pages = NULL;
+static pr_page_t *pr_dirs = NULL;
+static uint16_t *pr_dir_index = NULL;
+
+static uint32_t n_entries = 0, n_pages = 0, n_dirs = 0;
+
+static void *pr_map = NULL;
+static size_t pr_map_len = 0;
+
+/*
+ * The compiled index may be saved as binary file next to the text file
+ * which is then mapped instead of parsing the text on startup. The file
+ * is only valid on the machine it was compiled for, the header records
+ * the byte order and structure layout to reject foreign files, as well as
+ * size and modification time of the text file it was compiled from.
+ */
+#define PR_MAGIC   0x4e4c5052 /* NLPR */
+#define PR_VERSION 2
+
+struct protocol_file {
+	uint32_t magic;
+	uint16_t version;
+	uint16_t entry_size;
+	uint32_t n_entries;
+	uint32_t n_pages;
+	uint32_t n_dirs;
+	uint32_t reserved;
+	uint64_t src_mtime;
+	uint64_t src_size;
+	uint16_t dir_index[256];
+	/* followed by dirs, pages and entries */
+};
+
+/* port specifications are either a single port, an inclusive range of
+ * ports such as 10000-20000 or a '*' wildcard matching any port */
 static int
-avl_cmp_proto(const void *k1, const void *k2, void *ptr)
+parse_ports(const char *spec, uint16_t *start, uint16_t *end)
 {
-	return memcmp(k1, k2, offsetof(struct protocol, idx));
+	unsigned long n, m;
+	char *e;
+
+	if (!strcmp(spec, "*")) {
+		*start = 0;
+		*end = 65535;
+		return 0;
+	}
+
+	n = strtoul(spec, &e, 10);
+
+	if (e == spec || n > 65535)
+		return -EINVAL;
+
+	m = n;
+
+	if (*e == '-') {
+		spec = e + 1;
+		m = strtoul(spec, &e, 10);
+
+		if (e == spec || m > 65535 || m < n)
+			return -EINVAL;
+	}
+
+	if (*e)
+		return -EINVAL;
+
+	*start = n;
+	*end = m;
+
+	return 0;
 }
 
-static AVL_TREE(protocols, avl_cmp_proto, false, NULL);
+static uint16_t
+intern_page(pr_page_t *pages, uint32_t *n, const uint16_t *page)
+{
+	uint32_t i;
 
-int
-init_protocols(const char *database)
+	for (i = 0; i < *n; i++)
+		if (!memcmp(pages[i], page, sizeof(pr_page_t)))
+			return i;
+
+	memcpy(pages[*n], page, sizeof(pr_page_t));
+
+	return (*n)++;
+}
+
+static int
+compile_protocols(void)
 {
-	char *p = NULL, buf[PR_NAMELEN];
-	struct protocol *pr;
+	bool present[256] = { };
+	pr_page_t dir, *pages;
+	struct protocol *pr, *cur;
+	int proto, port, hi, n_protos = 0;
+	uint16_t *ports;
+	uint32_t n;
+
+	for (n = 1; n <= n_entries; n++) {
+		n_protos += !present[pr_entries[n].proto];
+		present[pr_entries[n].proto] = true;
+	}
+
+	/* page numbers must fit into the 16 bit directory slots */
+	if (n_protos > 255)
+		return -E2BIG;
+
+	n_pages = n_dirs = 1;
+
+	pr_pages = calloc(n_protos * 256 + 1, sizeof(*pr_pages));
+	pr_dirs = calloc(n_protos + 1, sizeof(*pr_dirs));
+	pr_dir_index = calloc(256, sizeof(*pr_dir_index));
+	ports = calloc(65536, sizeof(*ports));
+
+	if (!pr_pages || !pr_dirs || !pr_dir_index || !ports) {
+		free(pr_pages);
+		free(pr_dirs);
+		free(pr_dir_index);
+		free(ports);
+		pr_pages = NULL;
+		pr_dirs = NULL;
+		pr_dir_index = NULL;
+		return -ENOMEM;
+	}
+
+	for (proto = 0; proto < 256; proto++) {
+		if (!present[proto])
+			continue;
+
+		memset(ports, 0, 65536 * sizeof(*ports));
+
+		/* the narrowest range covering a port takes precedence, the
+		 * first line wins among equally wide ones */
+		for (n = 1; n <= n_entries; n++) {
+			pr = &pr_entries[n];
+
+			if (pr->proto != proto)
+				continue;
+
+			for (port = pr->port; port <= pr->port_end; port++) {
+				cur = &pr_entries[ports[port]];
+
+				if (!ports[port] ||
+				    pr->port_end - pr->port < cur->port_end - cur->port)
+					ports[port] = n;
+			}
+		}
+
+		/* flows are recorded under the lowest port each entry wins,
+		 * so that a range yields a single record per host */
+		for (port = 65535; port >= 0; port--)
+			pr_entries[ports[port]].key_port = port;
+
+		for (hi = 0; hi < 256; hi++)
+			dir[hi] = intern_page(pr_pages, &n_pages, &ports[hi * 256]);
+
+		pr_dir_index[proto] = intern_page(pr_dirs, &n_dirs, dir);
+	}
+
+	free(ports);
+
+	pr_entries[0].key_port = 0;
+
+	pages = realloc(pr_pages, n_pages * sizeof(*pr_pages));
+
+	if (pages)
+		pr_pages = pages;
+
+	return 0;
+}
+
+static void
+free_protocols(void)
+{
+	if (pr_map) {
+		munmap(pr_map, pr_map_len);
+	}
+	else {
+		free(pr_entries);
+		free(pr_pages);
+		free(pr_dirs);
+		free(pr_dir_index);
+	}
+
+	pr_map = NULL;
+	pr_entries = NULL;
+	pr_pages = NULL;
+	pr_dirs = NULL;
+	pr_dir_index = NULL;
+	n_entries = n_pages = n_dirs = 0;
+}
+
+static int
+parse_protocols(const char *database)
+{
+	char buf[PR_NAMELEN + 1], spec[16];
+	struct protocol *pr, *entries;
+	uint32_t size = 0;
 	uint16_t idx = 0;
-	uint16_t port;
+	uint16_t port, port_end;
 	uint8_t proto;
 	FILE *in;
 
-	in = fopen(opt.protocol_db, "r");
+	free_protocols();
+
+	in = fopen(database, "r");
 
 	if (!in)
 		return -errno;
 
-	while (fscanf(in, PR_SCANFMT, &proto, &port, buf) == 3)
+	/* entries are numbered from 1, slot 0 stays unused */
+	n_entries = 0;
+
+	while (fscanf(in, PR_SCANFMT, &proto, spec, buf) == 3)
 	{
-		if (!buf[0])
+		if (!buf[0] || parse_ports(spec, &port, &port_end))
 			continue;
 
-		if (!p || strcmp(p, buf))
-			idx++;
+		if (n_entries + 1 >= 65535) {
+			fclose(in);
+			return -E2BIG;
+		}
 
-		pr = calloc_a(sizeof(*pr), &p, strlen(buf) + 1);
+		if (n_entries + 1 >= size) {
+			size = size ? size * 2 : 64;
+			entries = realloc(pr_entries, size * sizeof(*pr_entries));
 
-		if (!pr) {
-			fclose(in);
-			return -ENOMEM;
+			if (!entries) {
+				fclose(in);
+				return -ENOMEM;
+			}
+
+			pr_entries = entries;
 		}
 
+		if (!n_entries || strcmp(pr_entries[n_entries].name, buf))
+			idx++;
+
+		pr = &pr_entries[++n_entries];
 		pr->proto = proto;
 		pr->port = port;
+		pr->port_end = port_end;
 		pr->idx = idx;
-		pr->name = strcpy(p, buf);
-		pr->node.key = pr;
-
-		avl_insert(&protocols, &pr->node);
+		strcpy(pr->name, buf);
 	}
 
 	fclose(in);
+
+	if (!pr_entries && !(pr_entries = calloc(1, sizeof(*pr_entries))))
+		return -ENOMEM;
+
+	memset(&pr_entries[0], 0, sizeof(pr_entries[0]));
+
+	return compile_protocols();
+}
+
+static char *
+compiled_path(const char *database)
+{
+	char *path = malloc(strlen(database) + sizeof(".bin"));
+
+	if (path)
+		sprintf(path, "%s.bin", database);
+
+	return path;
+}
+
+static bool
+check_index(const struct protocol_file *hdr)
+{
+	uint32_t i, j;
+
+	for (i = 0; i < 256; i++)
+		if (hdr->dir_index[i] >= hdr->n_dirs)
+			return false;
+
+	for (i = 0; i < hdr->n_dirs; i++)
+		for (j = 0; j < 256; j++)
+			if (pr_dirs[i][j] >= hdr->n_pages)
+				return false;
+
+	for (i = 0; i < hdr->n_pages; i++)
+		for (j = 0; j < 256; j++)
+			if (pr_pages[i][j] > hdr->n_entries)
+				return false;
+
+	/* names are printed as is, they must be terminated */
+	for (i = 0; i <= hdr->n_entries; i++)
+		if (pr_entries[i].name[PR_NAMELEN] != '\0')
+			return false;
+
+	return true;
+}
+
+/* map the compiled index if it was built from the current text file */
+static int
+map_protocols(const char *database)
+{
+	struct stat s_txt, s_bin;
+	struct protocol_file *hdr;
+	char *path, *p;
+	size_t len;
+	int fd;
+
+	path = compiled_path(database);
+
+	if (!path)
+		return -ENOMEM;
+
+	fd = open(path, O_RDONLY);
+	free(path);
+
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &s_bin) || s_bin.st_size < sizeof(*hdr)) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	hdr = mmap(NULL, s_bin.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+
+	if (hdr == MAP_FAILED)
+		return -errno;
+
+	len = sizeof(*hdr) + (hdr->n_dirs + hdr->n_pages) * sizeof(pr_page_t) +
+	      (hdr->n_entries + 1) * sizeof(struct protocol);
+
+	if (hdr->magic != PR_MAGIC || hdr->version != PR_VERSION ||
+	    hdr->entry_size != sizeof(struct protocol) ||
+	    hdr->n_pages > 65536 || hdr->n_dirs > 256 || hdr->n_entries > 65535 ||
+	    len != s_bin.st_size) {
+		munmap(hdr, s_bin.st_size);
+		return -EINVAL;
+	}
+
+	/* a missing text file is fine, a modified one needs recompiling */
+	if (!stat(database, &s_txt) &&
+	    (hdr->src_mtime != s_txt.st_mtime || hdr->src_size != s_txt.st_size)) {
+		munmap(hdr, s_bin.st_size);
+		return -ESTALE;
+	}
+
+	p = (char *)hdr + sizeof(*hdr);
+
+	pr_dirs = (pr_page_t *)p;
+	pr_pages = pr_dirs + hdr->n_dirs;
+	pr_entries = (struct protocol *)(pr_pages + hdr->n_pages);
+
+	if (!check_index(hdr)) {
+		munmap(hdr, s_bin.st_size);
+		pr_dirs = NULL;
+		pr_pages = NULL;
+		pr_entries = NULL;
+		return -EINVAL;
+	}
+
+	pr_map = hdr;
+	pr_map_len = s_bin.st_size;
+
+	pr_dir_index = hdr->dir_index;
+
+	n_dirs = hdr->n_dirs;
+	n_pages = hdr->n_pages;
+	n_entries = hdr->n_entries;
+
 	return 0;
 }
 
+int
+init_protocols(const char *database)
+{
+	free_protocols();
+
+	if (!map_protocols(database))
+		return 0;
+
+	return parse_protocols(database);
+}
+
+int
+save_protocols(const char *database)
+{
+	struct protocol_file hdr = {
+		.magic = PR_MAGIC,
+		.version = PR_VERSION,
+		.entry_size = sizeof(struct protocol)
+	};
+	struct stat s;
+	char *path, *tmp;
+	FILE *out;
+	int err;
+
+	if (stat(database, &s))
+		return -errno;
+
+	err = parse_protocols(database);
+
+	if (err)
+		return err;
+
+	hdr.n_entries = n_entries;
+	hdr.n_pages = n_pages;
+	hdr.n_dirs = n_dirs;
+	hdr.src_mtime = s.st_mtime;
+	hdr.src_size = s.st_size;
+
+	path = compiled_path(database);
+	tmp = path ? malloc(strlen(path) + sizeof(".tmp")) : NULL;
+
+	if (!tmp) {
+		free(path);
+		return -ENOMEM;
+	}
+
+	sprintf(tmp, "%s.tmp", path);
+	memcpy(hdr.dir_index, pr_dir_index, sizeof(hdr.dir_index));
+
+	out = fopen(tmp, "w");
+
+	if (!out) {
+		err = -errno;
+		goto out;
+	}
+
+	/* stdio does not necessarily set errno on short writes */
+	errno = 0;
+
+	if (fwrite(&hdr, sizeof(hdr), 1, out) != 1 ||
+	    fwrite(pr_dirs, sizeof(*pr_dirs), n_dirs, out) != n_dirs ||
+	    fwrite(pr_pages, sizeof(*pr_pages), n_pages, out) != n_pages ||
+	    fwrite(pr_entries, sizeof(*pr_entries), n_entries + 1, out) != n_entries + 1 ||
+	    fflush(out) || fsync(fileno(out)))
+		err = errno ? -errno : -EIO;
+
+	errno = 0;
+
+	if (fclose(out) && !err)
+		err = errno ? -errno : -EIO;
+
+	/* only replace the previous file once the new one is complete */
+	if (!err && rename(tmp, path))
+		err = -errno;
+
+	if (err)
+		unlink(tmp);
+
+out:
+	free(path);
+	free(tmp);
+
+	return err;
+}
+
 struct protocol *
 lookup_protocol(uint8_t proto, uint16_t port)
 {
-	struct protocol *pr, key = { };
+	uint16_t n;
+
+	if (!pr_pages)
+		return NULL;
 
-	key.proto = proto;
-	key.port = port;
+	n = pr_pages[pr_dirs[pr_dir_index[proto]][port >> 8]][port & 0xFF];
 
-	return avl_find_element(&protocols, &key, pr, node);
+	return n ? &pr_entries[n] : NULL;
 }
@@ -20,21 +20,22 @@
 #define __PROTOCOL_H__
 
 #include <stdint.h>
-#include <libubox/avl.h>
 
 #define PR_NAMELEN 32
-#define PR_SCANFMT "%hhu %hu %32[^\n]\n"
+#define PR_SCANFMT "%hhu %15s %32[^\n]\n"
 
 
 struct protocol {
 	uint8_t proto;
 	uint16_t port;
+	uint16_t port_end;
 	uint16_t idx;
-	char *name;
-	struct avl_node node;
+	uint16_t key_port;
+	char name[PR_NAMELEN + 1];
 };
 
 int init_protocols(const char *database);
+int save_protocols(const char *database);
 struct protocol * lookup_protocol(uint8_t proto, uint16_t port);
 
 #endif /* __PROTOCOL_H__ */
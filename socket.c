@@ -21,14 +21,19 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdlib.h>
+#include <inttypes.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/ether.h>
 
 #include <libubox/uloop.h>
 #include <libubox/usock.h>
 
 #include "socket.h"
 #include "database.h"
+#include "nfnetlink.h"
+#include "neigh.h"
 #include "timing.h"
 #include "nlbwmon.h"
 
@@ -80,6 +85,7 @@ handle_dump(int sock, const char *arg)
 
 	if (timestamp == 0) {
 		h = gdbh;
+		nfnetlink_refresh(false);
 	}
 	else {
 		h = database_init(&opt.archive_interval, false, 0);
@@ -156,10 +162,99 @@ handle_commit(int sock, const char *arg)
 	return 0;
 }
 
+/* some counters are updated by the ingest and dump threads */
+#define STAT(field) __atomic_load_n(&nfnl_stats.field, __ATOMIC_RELAXED)
+
+static int
+handle_stats(int sock, const char *arg)
+{
+	char buf[64];
+	int i, len;
+
+	struct {
+		const char *name;
+		uint64_t value;
+	} stats[] = {
+		{ "nfnl_wakeups",    STAT(wakeups) },
+		{ "nfnl_messages",   STAT(messages) },
+		{ "nfnl_truncated",  STAT(truncated) },
+		{ "nfnl_overflows",  nfnl_stats.overflows  },
+		{ "nfnl_lost",       nfnl_stats.lost       },
+		{ "nfnl_resyncs",    nfnl_stats.resyncs    },
+		{ "nfnl_bufsize",    nfnl_stats.bufsize    },
+		{ "nfnl_grows",      nfnl_stats.grows      },
+		{ "nfnl_shrinks",    nfnl_stats.shrinks    },
+		{ "nfnl_ring_stalls", STAT(ring_stalls) },
+		{ "nfnl_yields",     nfnl_stats.yields     },
+		{ "nfnl_agg_in",     nfnl_stats.agg_in     },
+		{ "nfnl_agg_out",    nfnl_stats.agg_out    },
+		{ "nfnl_insert_overflows", nfnl_stats.insert_overflows },
+		{ "neigh_entries",   neigh_stats.entries   },
+		{ "neigh_hits",      neigh_stats.hits      },
+		{ "neigh_misses",    neigh_stats.misses    },
+		{ "neigh_negative",  neigh_stats.negative  },
+		{ "neigh_queries",   neigh_stats.queries   },
+		{ "neigh_evictions", neigh_stats.evictions },
+		{ "nfnl_batch_last", STAT(batch_last) },
+		{ "nfnl_batch_max",  STAT(batch_max) },
+	};
+
+	for (i = 0; i < sizeof(stats) / sizeof(stats[0]); i++) {
+		len = snprintf(buf, sizeof(buf), "%s %"PRIu64"\n",
+		               stats[i].name, stats[i].value);
+
+		if (send_data(sock, buf, len) != len)
+			return -errno;
+	}
+
+	return 0;
+}
+
+static int
+handle_addresses(int sock, const char *arg)
+{
+	struct neigh_recent *rh = NULL;
+	char buf[INET6_ADDRSTRLEN + 1];
+	struct in6_addr prefix = { };
+	int i, len;
+
+	while ((rh = neigh_recent_next(rh)) != NULL) {
+		memcpy(prefix.s6_addr, rh->key.prefix, sizeof(rh->key.prefix));
+
+		len = snprintf(buf, sizeof(buf), "%s ", ether_ntoa(&rh->key.mac));
+
+		if (send_data(sock, buf, len) != len)
+			return -errno;
+
+		inet_ntop(AF_INET6, &prefix, buf, sizeof(buf));
+		len = strlen(buf);
+
+		if (send_data(sock, buf, len) != len ||
+		    send_data(sock, "/64", 3) != 3)
+			return -errno;
+
+		for (i = 0; i < rh->count; i++) {
+			buf[0] = ' ';
+			inet_ntop(AF_INET6, &rh->addrs[i], buf + 1, sizeof(buf) - 1);
+			len = strlen(buf);
+
+			if (send_data(sock, buf, len) != len)
+				return -errno;
+		}
+
+		if (send_data(sock, "\n", 1) != 1)
+			return -errno;
+	}
+
+	return 0;
+}
+
 static struct command commands[] = {
 	{ "dump", handle_dump },
 	{ "list", handle_list },
 	{ "commit", handle_commit },
+	{ "stats", handle_stats },
+	{ "addresses", handle_addresses },
 };
 
 
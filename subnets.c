@@ -17,24 +17,167 @@
 */
 
 #include <stdlib.h>
+#include <stdbool.h>
 #include <string.h>
 #include <errno.h>
 #include <endian.h>
 #include <arpa/inet.h>
+#include <net/if.h>
+#include <linux/rtnetlink.h>
 
 #include <libubox/list.h>
 
 #include "subnets.h"
+#include "neigh.h"
 
 
-static LIST_HEAD(subnets);
+/* subnets given on the command line */
+static LIST_HEAD(configured);
+
+/* interfaces whose addresses define further local subnets */
+struct subnet_iface {
+	struct list_head list;
+	char name[IFNAMSIZ];
+};
+
+static LIST_HEAD(interfaces);
+
+/*
+ * Contiguous subnet masks are additionally compiled into a multibit trie
+ * per address family, consuming four address bits per level.  Prefixes not
+ * ending on a nibble boundary are expanded to all covered slots of their
+ * last node, so a lookup is a walk of at most 8 (IPv4) or 32 (IPv6) nodes
+ * regardless of the number of configured subnets.  Subnets with
+ * non-contiguous masks cannot be expressed that way and are matched from
+ * the list of irregular subnets instead.
+ */
+struct subnet_node {
+	uint16_t covered;
+	struct subnet_node *child[16];
+};
+
+/*
+ * The lookup structures are bundled in a table which is rebuilt from
+ * scratch whenever the interface addresses change and then published with
+ * a single pointer store, so lookups never observe a partial update.
+ */
+struct subnet_table {
+	struct subnet_node *trie4;
+	struct subnet_node *trie6;
+	struct list_head irregular;
+	struct list_head subnets;
+};
+
+static struct subnet_table *table = NULL;
+
+static inline uint8_t
+addr_nibble(int family, const struct in6_addr *addr, int i)
+{
+	if (family == AF_INET)
+		return (addr->s6_addr32[0] >> (28 - 4 * i)) & 0xF;
+
+	return (i & 1) ? (addr->s6_addr[i / 2] & 0xF) : (addr->s6_addr[i / 2] >> 4);
+}
+
+static int
+prefix_length(struct subnet *net)
+{
+	uint32_t m;
+	int i, len = 0;
+
+	if (net->family == AF_INET) {
+		m = net->smask.in.s_addr;
+
+		/* inverted mask plus one must be a power of two */
+		if (~m & (~m + 1))
+			return -1;
+
+		return __builtin_popcount(m);
+	}
+
+	for (i = 0; i < 128; i++) {
+		if (addr_nibble(AF_INET6, &net->smask.in6, i / 4) & (8 >> (i % 4))) {
+			if (len < i)
+				return -1;
+
+			len++;
+		}
+	}
+
+	return len;
+}
+
+static int
+trie_insert(struct subnet_node **root, struct subnet *net, int len)
+{
+	struct subnet_node **node = root;
+	int i, depth, rem;
+	uint8_t n;
+
+	depth = len ? (len - 1) / 4 : 0;
+	rem = len - depth * 4;
+
+	for (i = 0; i <= depth; i++) {
+		if (!*node) {
+			*node = calloc(1, sizeof(**node));
+
+			if (!*node)
+				return -ENOMEM;
+		}
+
+		if (i == depth)
+			break;
+
+		node = &(*node)->child[addr_nibble(net->family, &net->saddr.in6, i)];
+	}
+
+	/* expand the remaining prefix bits to all slots sharing them */
+	n = addr_nibble(net->family, &net->saddr.in6, depth) & (0xF0 >> rem);
+	(*node)->covered |= ((1 << (1 << (4 - rem))) - 1) << n;
+
+	return 0;
+}
+
+static bool
+trie_lookup(struct subnet_node *node, int family, const struct in6_addr *addr)
+{
+	int i;
+	uint8_t n;
+
+	for (i = 0; node; i++) {
+		n = addr_nibble(family, addr, i);
+
+		if (node->covered & (1 << n))
+			return true;
+
+		node = node->child[n];
+	}
+
+	return false;
+}
+
+static void
+prefix_mask(struct subnet *net, unsigned long int n)
+{
+	uint8_t i, b;
+
+	if (net->family == AF_INET) {
+		net->smask.in.s_addr = n ? ~((1 << (32 - n)) - 1) : 0;
+		return;
+	}
+
+	for (i = 0; i < sizeof(net->smask.in6.s6_addr); i++) {
+		b = (n > 8) ? 8 : n;
+		net->smask.in6.s6_addr[i] = (uint8_t)(0xFF << (8 - b));
+		n -= b;
+	}
+}
 
 static int
 parse_subnet(const char *addr, struct subnet *net)
 {
 	char *mask, *e, tmp[INET6_ADDRSTRLEN] = { };
 	unsigned long int n;
-	uint8_t i, b;
 
 	mask = strchr(addr, '/');
 
@@ -56,11 +199,7 @@ parse_subnet(const char *addr, struct subnet *net)
 			if (n > 128)
 				return -ERANGE;
 
-			for (i = 0; i < sizeof(net->smask.in6.s6_addr); i++) {
-				b = (n > 8) ? 8 : n;
-				net->smask.in6.s6_addr[i] = (uint8_t)(0xFF << (8 - b));
-				n -= b;
-			}
+			prefix_mask(net, n);
 		}
 
 		return 0;
@@ -83,7 +222,7 @@ parse_subnet(const char *addr, struct subnet *net)
 			if (n > 32)
 				return -ERANGE;
 
-			net->smask.in.s_addr = n ? ~((1 << (32 - n)) - 1) : 0;
+			prefix_mask(net, n);
 		}
 
 		return 0;
@@ -92,6 +231,79 @@ parse_subnet(const char *addr, struct subnet *net)
 	return -EINVAL;
 }
 
+static void
+trie_free(struct subnet_node *node)
+{
+	int i;
+
+	if (!node)
+		return;
+
+	for (i = 0; i < 16; i++)
+		trie_free(node->child[i]);
+
+	free(node);
+}
+
+static struct subnet_table *
+table_new(void)
+{
+	struct subnet_table *t = calloc(1, sizeof(*t));
+
+	if (!t)
+		return NULL;
+
+	INIT_LIST_HEAD(&t->irregular);
+	INIT_LIST_HEAD(&t->subnets);
+
+	return t;
+}
+
+static void
+table_free(struct subnet_table *t)
+{
+	struct subnet *net, *tmp;
+
+	if (!t)
+		return;
+
+	list_for_each_entry_safe(net, tmp, &t->subnets, list)
+		free(net);
+
+	trie_free(t->trie4);
+	trie_free(t->trie6);
+	free(t);
+}
+
+static int
+table_add(struct subnet_table *t, const struct subnet *src)
+{
+	struct subnet *net = malloc(sizeof(*net));
+	int err, len;
+
+	if (!net)
+		return -ENOMEM;
+
+	*net = *src;
+	len = prefix_length(net);
+
+	if (len < 0) {
+		list_add_tail(&net->irregular, &t->irregular);
+	}
+	else {
+		err = trie_insert((net->family == AF_INET) ? &t->trie4 : &t->trie6,
+		                  net, len);
+
+		if (err != 0) {
+			free(net);
+			return err;
+		}
+	}
+
+	list_add_tail(&net->list, &t->subnets);
+	return 0;
+}
+
 int
 add_subnet(const char *addr)
 {
@@ -103,25 +315,124 @@ add_subnet(const char *addr)
 
 	err = parse_subnet(addr, net);
 
+	if (err == 0 && !table && !(table = table_new()))
+		err = -ENOMEM;
+
+	if (err == 0)
+		err = table_add(table, net);
+
 	if (err != 0) {
 		free(net);
 		return err;
 	}
 
-	list_add_tail(&net->list, &subnets);
+	list_add_tail(&net->list, &configured);
 	return 0;
 }
 
+int
+add_subnet_interface(const char *ifname)
+{
+	struct subnet_iface *iface;
+
+	if (strlen(ifname) >= IFNAMSIZ)
+		return -ENAMETOOLONG;
+
+	iface = calloc(1, sizeof(*iface));
+
+	if (!iface)
+		return -ENOMEM;
+
+	strcpy(iface->name, ifname);
+	list_add_tail(&iface->list, &interfaces);
+
+	return 0;
+}
+
+static bool
+match_interface(int ifindex)
+{
+	struct subnet_iface *iface;
+	char name[IFNAMSIZ];
+
+	if (!if_indextoname(ifindex, name))
+		return false;
+
+	list_for_each_entry(iface, &interfaces, list)
+		if (!strcmp(iface->name, name))
+			return true;
+
+	return false;
+}
+
+int
+update_subnets(void)
+{
+	struct subnet_table *t, *old;
+	struct addr_entry *ae = NULL;
+	struct subnet *net, tmp;
+	int i, err = 0;
+
+	if (list_empty(&interfaces))
+		return 0;
+
+	t = table_new();
+
+	if (!t)
+		return -ENOMEM;
+
+	list_for_each_entry(net, &configured, list)
+		if ((err = table_add(t, net)) != 0)
+			goto out;
+
+	while ((ae = neigh_address_next(ae)) != NULL) {
+		if (ae->scope >= RT_SCOPE_LINK || !match_interface(ae->ifindex))
+			continue;
+
+		memset(&tmp, 0, sizeof(tmp));
+
+		tmp.family = ae->key.data.family;
+		tmp.saddr.in6 = ae->key.data.addr.in6;
+		prefix_mask(&tmp, ae->prefixlen);
+
+		if (tmp.family == AF_INET)
+			tmp.saddr.in.s_addr = be32toh(tmp.saddr.in.s_addr);
+
+		for (i = 0; i < 4; i++)
+			tmp.saddr.in6.s6_addr32[i] &= tmp.smask.in6.s6_addr32[i];
+
+		if ((err = table_add(t, &tmp)) != 0)
+			goto out;
+	}
+
+	old = table;
+	__atomic_store_n(&table, t, __ATOMIC_RELEASE);
+
+	/* lookups only happen on the main thread, so the old table is no longer
+	 * referenced at this point */
+	table_free(old);
+
+	return 1;
+
+out:
+	table_free(t);
+	return err;
+}
+
 int
 match_subnet(int family, struct in6_addr *addr)
 {
+	struct subnet_table *t = __atomic_load_n(&table, __ATOMIC_ACQUIRE);
 	struct subnet *net;
 	uint32_t *a, *b, *m;
 
-	if (list_empty(&subnets))
+	if (!t)
 		return -ENOENT;
 
-	list_for_each_entry(net, &subnets, list) {
+	if (trie_lookup((family == AF_INET) ? t->trie4 : t->trie6, family, addr))
+		return 0;
+
+	list_for_each_entry(net, &t->irregular, irregular) {
 		a = addr->s6_addr32;
 		b = net->saddr.in6.s6_addr32;
 		m = net->smask.in6.s6_addr32;
@@ -140,3 +451,19 @@ match_subnet(int family, struct in6_addr *addr)
 
 	return -ENOENT;
 }
+
+struct subnet *
+next_subnet(struct subnet *prev)
+{
+	struct list_head *next;
+
+	if (!table)
+		return NULL;
+
+	next = prev ? prev->list.next : table->subnets.next;
+
+	if (next == &table->subnets)
+		return NULL;
+
+	return list_entry(next, struct subnet, list);
+}
@@ -27,6 +27,7 @@
 
 struct subnet {
 	struct list_head list;
+	struct list_head irregular;
 	uint8_t family;
 	union {
 		struct in_addr in;
@@ -39,6 +40,10 @@ struct subnet {
 };
 
 int add_subnet(const char *addr);
+int add_subnet_interface(const char *ifname);
+int update_subnets(void);
 int match_subnet(int family, struct in6_addr *addr);
 
+struct subnet * next_subnet(struct subnet *prev);
+
 #endif /* __SUBNETS_H__ */
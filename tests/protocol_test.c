@@ -0,0 +1,161 @@
+/*
+  ISC License
+
+  Copyright (c) 2016-2017, Jo-Philipp Wich <jo@mein.io>
+
+  Permission to use, copy, modify, and/or distribute this software for any
+  purpose with or without fee is hereby granted, provided that the above
+  copyright notice and this permission notice appear in all copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+  REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+  AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+  INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+  LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+  OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+  PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../protocol.h"
+
+static const char rules[] =
+	"17 5000 sip\n"
+	"17 5000-6000 rtp\n"
+	"6 1-1023 wellknown\n"
+	"6 1 tcpmux\n"
+	"6 443 https\n"
+	"6 * tcp\n";
+
+/* key is the port flows matching the case are recorded under */
+static const struct {
+	uint8_t proto;
+	uint16_t port;
+	const char *name;
+	uint16_t key;
+} cases[] = {
+	{ 17, 5000,  "sip",       5000 },
+	{ 17, 4999,  NULL,        0    },
+	{ 17, 5001,  "rtp",       5001 },
+	{ 17, 6000,  "rtp",       5001 },
+	{ 17, 6001,  NULL,        0    },
+	{ 6,  0,     "tcp",       0    },
+	{ 6,  1,     "tcpmux",    1    },
+	{ 6,  2,     "wellknown", 2    },
+	{ 6,  443,   "https",     443  },
+	{ 6,  1023,  "wellknown", 2    },
+	{ 6,  1024,  "tcp",       0    },
+	{ 6,  65535, "tcp",       0    },
+	{ 1,  0,     NULL,        0    },
+};
+
+static int
+check(const char *what)
+{
+	struct protocol *pr;
+	int i, fail = 0;
+
+	for (i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		pr = lookup_protocol(cases[i].proto, cases[i].port);
+
+		if (pr ? (!cases[i].name || strcmp(pr->name, cases[i].name))
+		       : !!cases[i].name) {
+			fprintf(stderr, "%s: %u/%u resolved to %s, expected %s\n",
+			        what, cases[i].proto, cases[i].port,
+			        pr ? pr->name : "none",
+			        cases[i].name ? cases[i].name : "none");
+			fail = 1;
+		}
+		else if (pr && (pr->key_port != cases[i].key ||
+		                lookup_protocol(cases[i].proto, pr->key_port) != pr)) {
+			fprintf(stderr, "%s: %u/%u recorded as port %u, expected %u\n",
+			        what, cases[i].proto, cases[i].port,
+			        pr->key_port, cases[i].key);
+			fail = 1;
+		}
+	}
+
+	return fail;
+}
+
+int
+main(int argc, char **argv)
+{
+	char dir[] = "/tmp/protocol_test.XXXXXX", path[64], bin[80];
+	struct protocol pr;
+	int err, fail = 0;
+	FILE *f;
+
+	if (!mkdtemp(dir))
+		return 1;
+
+	snprintf(path, sizeof(path), "%s/protocols", dir);
+	snprintf(bin, sizeof(bin), "%s.bin", path);
+
+	f = fopen(path, "w");
+
+	if (!f || fwrite(rules, 1, sizeof(rules) - 1, f) != sizeof(rules) - 1)
+		return 1;
+
+	fclose(f);
+
+	err = init_protocols(path);
+
+	if (err) {
+		fprintf(stderr, "init_protocols: %s\n", strerror(-err));
+		fail = 1;
+	}
+	else {
+		fail |= check("text");
+	}
+
+	/* the compiled file must resolve the same way once mapped */
+	err = save_protocols(path);
+
+	if (!err)
+		err = init_protocols(path);
+
+	if (err) {
+		fprintf(stderr, "compiled: %s\n", strerror(-err));
+		fail = 1;
+	}
+	else {
+		fail |= check("compiled");
+	}
+
+	/* an unterminated name must make the compiled file get ignored */
+	if (!err) {
+		f = fopen(bin, "r+");
+
+		if (!f || fseek(f, -(long)sizeof(struct protocol), SEEK_END)) {
+			fail = 1;
+		}
+		else {
+			memset(&pr, 'A', sizeof(pr));
+			fwrite(&pr, sizeof(pr), 1, f);
+		}
+
+		if (f)
+			fclose(f);
+
+		err = init_protocols(path);
+
+		if (err) {
+			fprintf(stderr, "corrupted: %s\n", strerror(-err));
+			fail = 1;
+		}
+		else {
+			fail |= check("corrupted");
+		}
+	}
+
+	unlink(path);
+	unlink(bin);
+	rmdir(dir);
+
+	return fail;
+}
@@ -0,0 +1,214 @@
+/*
+  ISC License
+
+  Copyright (c) 2016-2017, Jo-Philipp Wich <jo@mein.io>
+
+  Permission to use, copy, modify, and/or distribute this software for any
+  purpose with or without fee is hereby granted, provided that the above
+  copyright notice and this permission notice appear in all copies.
+
+  THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES WITH
+  REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+  AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY SPECIAL, DIRECT,
+  INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM
+  LOSS OF USE, DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE
+  OR OTHER TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR
+  PERFORMANCE OF THIS SOFTWARE.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#include "../subnets.h"
+#include "../neigh.h"
+
+#define N_ADDRS 4096
+#define N_LOOKUPS 2000000
+
+static const int sizes[] = { 1, 10, 100, 1000, 10000 };
+
+static struct in6_addr addrs[N_ADDRS];
+static int families[N_ADDRS];
+
+/* interface addresses are only consulted by update_subnets() */
+struct addr_entry *
+neigh_address_next(struct addr_entry *prev)
+{
+	return NULL;
+}
+
+/* the linear list walk the trie replaced */
+static int
+match_list(int family, struct in6_addr *addr)
+{
+	struct subnet *net = NULL;
+	uint32_t *a, *b, *m;
+
+	while ((net = next_subnet(net)) != NULL) {
+		a = addr->s6_addr32;
+		b = net->saddr.in6.s6_addr32;
+		m = net->smask.in6.s6_addr32;
+
+		if (net->family != family)
+			continue;
+
+		if (((a[0] & m[0]) != (b[0] & m[0])) ||
+		    ((a[1] & m[1]) != (b[1] & m[1])) ||
+		    ((a[2] & m[2]) != (b[2] & m[2])) ||
+		    ((a[3] & m[3]) != (b[3] & m[3])))
+			continue;
+
+		return 0;
+	}
+
+	return -ENOENT;
+}
+
+/* random prefixes of any length, every tenth IPv4 one with a
+ * non-contiguous mask */
+static int
+add_random_subnet(int i)
+{
+	char buf[INET6_ADDRSTRLEN + 16];
+	struct in6_addr a6;
+	struct in_addr a4;
+	int k;
+
+	for (k = 0; k < 16; k++)
+		a6.s6_addr[k] = rand();
+
+	memcpy(&a4, &a6, sizeof(a4));
+
+	if (i % 2) {
+		inet_ntop(AF_INET6, &a6, buf, sizeof(buf));
+		sprintf(buf + strlen(buf), "/%d", 1 + rand() % 128);
+	}
+	else if (i % 10) {
+		inet_ntop(AF_INET, &a4, buf, sizeof(buf));
+		sprintf(buf + strlen(buf), "/%d", 1 + rand() % 32);
+	}
+	else {
+		inet_ntop(AF_INET, &a4, buf, sizeof(buf));
+		sprintf(buf + strlen(buf), "/255.%d.255.0", rand() % 256);
+	}
+
+	return add_subnet(buf);
+}
+
+/* half of the addresses are derived from configured subnets so that the
+ * lookups cover hits at all prefix lengths */
+static void
+init_addrs(void)
+{
+	struct subnet *net, *nets[N_ADDRS];
+	int i, k, n = 0;
+
+	for (net = next_subnet(NULL); net && n < N_ADDRS; net = next_subnet(net))
+		nets[n++] = net;
+
+	for (i = 0; i < N_ADDRS; i++) {
+		for (k = 0; k < 16; k++)
+			addrs[i].s6_addr[k] = rand();
+
+		families[i] = (rand() % 2) ? AF_INET6 : AF_INET;
+
+		if (i % 2)
+			continue;
+
+		net = nets[rand() % n];
+		families[i] = net->family;
+
+		for (k = 0; k < 4; k++)
+			addrs[i].s6_addr32[k] =
+				(net->saddr.in6.s6_addr32[k] & net->smask.in6.s6_addr32[k]) |
+				(addrs[i].s6_addr32[k] & ~net->smask.in6.s6_addr32[k]);
+	}
+
+	for (i = 0; i < N_ADDRS; i++)
+		if (families[i] == AF_INET)
+			memset(&addrs[i].s6_addr32[1], 0, 12);
+}
+
+static int
+check(int size)
+{
+	int i, fail = 0;
+
+	for (i = 0; i < N_ADDRS; i++) {
+		if (match_subnet(families[i], &addrs[i]) !=
+		    match_list(families[i], &addrs[i])) {
+			fprintf(stderr, "%d subnets: lookup %d differs from list\n",
+			        size, i);
+			fail = 1;
+		}
+	}
+
+	return fail;
+}
+
+static double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bench(int size)
+{
+	double t_trie, t_list;
+	volatile int sink = 0;
+	int i;
+
+	t_trie = now();
+
+	for (i = 0; i < N_LOOKUPS; i++)
+		sink += match_subnet(families[i % N_ADDRS], &addrs[i % N_ADDRS]);
+
+	t_trie = now() - t_trie;
+	t_list = now();
+
+	for (i = 0; i < N_LOOKUPS; i++)
+		sink += match_list(families[i % N_ADDRS], &addrs[i % N_ADDRS]);
+
+	t_list = now() - t_list;
+
+	printf("%5d subnets: %12.0f lookups/s, list walk %12.0f lookups/s\n",
+	       size, N_LOOKUPS / t_trie, N_LOOKUPS / t_list);
+}
+
+int
+main(int argc, char **argv)
+{
+	bool do_bench = (argc > 1 && !strcmp(argv[1], "bench"));
+	int i, n = 0, err, fail = 0;
+
+	srand(1);
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		for (; n < sizes[i]; n++) {
+			err = add_random_subnet(n);
+
+			if (err) {
+				fprintf(stderr, "add_subnet: %s\n", strerror(-err));
+				return 1;
+			}
+		}
+
+		init_addrs();
+		fail |= check(n);
+
+		if (do_bench)
+			bench(n);
+	}
+
+	return fail;
+}